@@ -0,0 +1,72 @@
+#!/bin/sh
+# Time gThumb's first window with the faces extension enabled and disabled.
+#
+# usage: bench-startup.sh [runs] [folder]
+#
+# Needs a running X session, xdotool, gsettings and timeout. The active
+# extension list is restored on exit. Each run starts gThumb on <folder>,
+# waits (up to $TIMEOUT seconds, default 30) for its first visible window and
+# kills it; the median of each set is printed.
+#
+# gThumb is single instance: with one already running, a new one hands its
+# folder over and exits without a window of its own, so close gThumb first.
+
+RUNS=${1:-10}
+FOLDER=${2:-$HOME}
+TIMEOUT=${TIMEOUT:-30}
+KEY="org.gnome.gthumb.general active-extensions"
+
+for tool in gthumb xdotool gsettings timeout pgrep; do
+    command -v $tool >/dev/null || { echo "bench-startup: $tool not found" >&2; exit 1; }
+done
+if pgrep -x gthumb >/dev/null; then
+    echo "bench-startup: gthumb is already running, close it first" >&2
+    exit 1
+fi
+
+SAVED=$(gsettings get $KEY)
+trap 'gsettings set $KEY "$SAVED"' EXIT INT TERM
+
+# the saved list, with and without 'faces'
+WITHOUT=$(echo "$SAVED" | sed -e "s/'faces', //g" -e "s/, 'faces'//g" -e "s/'faces'//g")
+case "$WITHOUT" in
+    *\'*) WITH=$(echo "$WITHOUT" | sed -e "s/^\['/['faces', '/") ;;
+    *) WITH="['faces']" ;;
+esac
+
+# one run: milliseconds from exec to first visible gThumb window
+run() {
+    start=$(date +%s%N)
+    gthumb "$FOLDER" >/dev/null 2>&1 &
+    pid=$!
+    timeout $TIMEOUT xdotool search --sync --onlyvisible --pid $pid >/dev/null
+    ok=$?
+    end=$(date +%s%N)
+    kill $pid 2>/dev/null
+    wait $pid 2>/dev/null
+    if [ $ok -ne 0 ]; then
+        echo "bench-startup: no gthumb window within ${TIMEOUT}s" >&2
+        return 1
+    fi
+    echo $(( (end - start) / 1000000 ))
+}
+
+median() {
+    sort -n | awk '{ v[NR] = $1 } END { print (NR % 2) ? v[(NR + 1) / 2] : (v[NR / 2] + v[NR / 2 + 1]) / 2 }'
+}
+
+bench() {
+    gsettings set $KEY "$2"
+    run >/dev/null || exit 1    # warm the page cache
+    times=
+    i=0
+    while [ $i -lt $RUNS ]; do
+        t=$(run) || exit 1
+        times="$times $t"
+        i=$((i + 1))
+    done
+    echo $times | tr ' ' '\n' | median | sed "s/^/$1: median first window (ms): /"
+}
+
+bench disabled "$WITHOUT"
+bench enabled "$WITH"
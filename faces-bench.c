@@ -0,0 +1,108 @@
+/* -*- Mode: C; tab-width: 4; expand-tabs; indent-tabs-mode: t; c-basic-offset: 4 -*- */
+
+/*
+ *  faces-bench - compare the cost of drawing faces with labels against
+ *  outlines only, using the drawing code the viewer shares (faces-paint.h)
+ *  on a cairo image surface.
+ *
+ *  usage: faces-bench [<faces> [<frames>]]
+ *
+ *  Draws <faces> (default 300) random faces from a 12000x3000 panorama,
+ *  scaled to fit a 1920x1080 surface so every face is in view, <frames>
+ *  (default 100) times per mode, and prints the time per frame.
+ *
+ *  This is the worst case for the viewer's painter, every face drawn over
+ *  the whole surface: it leaves out the grid culling and the clip to the
+ *  damaged area, so it does not measure a real frame, only what dropping
+ *  the labels during a gesture saves.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "faces-paint.h"
+
+#define PANO_W 12000
+#define PANO_H 3000
+#define SURFACE_W 1920
+#define SURFACE_H 1080
+
+typedef struct {
+    int l, t, r, b, p;
+    char n[32], g[16];
+} Face;
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+// one frame, every face (labels) or batched by outline style (outlines only)
+static void paint(cairo_t *cr, Face *faces, int n, double z, int labels) {
+    int i, pass;
+    if (labels) {
+        for (i = 0; i < n; i++) {
+            Face *f = &faces[i];
+            faces_draw_face(cr, (int)(f->l*z), (int)(f->t*z), (int)(f->r*z), (int)(f->b*z), f->n, f->g, f->p);
+        }
+        return;
+    }
+    cairo_save(cr);
+    for (pass = 0; pass < 2; pass++) {
+        faces_outline_style(cr, pass);
+        for (i = 0; i < n; i++) {
+            Face *f = &faces[i];
+            if ((f->p > 0) == pass)
+                cairo_rectangle(cr, (int)(f->l*z), (int)(f->t*z), (int)((f->r - f->l)*z), (int)((f->b - f->t)*z));
+        }
+        cairo_stroke(cr);
+    }
+    cairo_restore(cr);
+}
+
+int main(int argc, char **argv) {
+    int n = argc > 1 ? atoi(argv[1]) : 300;
+    int frames = argc > 2 ? atoi(argv[2]) : 100;
+    double ms[2];
+    int i, mode;
+
+    if (argc > 3 || n <= 0 || frames <= 0) {
+        fprintf(stderr, "usage: %s [<faces> [<frames>]]\n", argv[0]);
+        return 2;
+    }
+    Face *faces = calloc(n, sizeof(Face));
+    if (!faces) {
+        fputs("faces-bench: out of memory\n", stderr);
+        return 1;
+    }
+    srand(1);
+    for (i = 0; i < n; i++) {
+        int size = 100 + rand() % 300;
+        faces[i].l = rand() % (PANO_W - size);
+        faces[i].t = rand() % (PANO_H - size);
+        faces[i].r = faces[i].l + size;
+        faces[i].b = faces[i].t + size;
+        faces[i].p = rand() % 4 != 0;
+        snprintf(faces[i].n, sizeof(faces[i].n), "Person %d", rand() % 5000);
+        snprintf(faces[i].g, sizeof(faces[i].g), "%d", rand() % 2000);
+    }
+    double z = (double)SURFACE_W / PANO_W < (double)SURFACE_H / PANO_H ?
+        (double)SURFACE_W / PANO_W : (double)SURFACE_H / PANO_H;
+    cairo_surface_t *cs = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, SURFACE_W, SURFACE_H);
+    cairo_t *cr = cairo_create(cs);
+    for (mode = 0; mode < 2; mode++) {
+        paint(cr, faces, n, z, !mode);      // warm up font and glyph caches
+        double start = now_ms();
+        for (i = 0; i < frames; i++)
+            paint(cr, faces, n, z, !mode);
+        cairo_surface_flush(cs);
+        ms[mode] = (now_ms() - start) / frames;
+    }
+    cairo_destroy(cr);
+    cairo_surface_destroy(cs);
+    free(faces);
+    printf("%d faces, %d frames, %dx%d: labels %.3fms, outlines only %.3fms per frame (%.1fx)\n",
+        n, frames, SURFACE_W, SURFACE_H, ms[0], ms[1], ms[1] > 0 ? ms[0] / ms[1] : 0.0);
+    return 0;
+}
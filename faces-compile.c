@@ -0,0 +1,384 @@
+/* -*- Mode: C; tab-width: 4; expand-tabs; indent-tabs-mode: t; c-basic-offset: 4 -*- */
+
+/*
+ *  faces-compile - write the binary index (see faces-index.h) for a
+ *  faces.db, so the gThumb extension can map it instead of querying SQLite.
+ *
+ *  usage: faces-compile <faces.db> [<output>]
+ *
+ *  The output defaults to <faces.db>.idx, which is where the extension looks
+ *  for it. Re-run after the database changes, the extension ignores an index
+ *  older than its database.
+ */
+
+#include <sqlite3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "faces-index.h"
+
+// growable byte buffer, used for every section
+typedef struct {
+    char *data;
+    size_t len, cap;
+} Buf;
+
+static void *buf_add(Buf *b, const void *p, size_t n) {
+    if (b->len + n > b->cap) {
+        b->cap = b->cap ? b->cap*2 : 4096;
+        while (b->cap < b->len + n)
+            b->cap *= 2;
+        b->data = realloc(b->data, b->cap);
+        if (!b->data) {
+            fputs("faces-compile: out of memory\n", stderr);
+            exit(1);
+        }
+    }
+    void *at = b->data + b->len;
+    if (p)
+        memcpy(at, p, n);
+    else
+        memset(at, 0, n);
+    b->len += n;
+    return at;
+}
+
+static uint32_t add_string(Buf *strings, const char *s) {
+    uint32_t off = (uint32_t)strings->len;
+    buf_add(strings, s, strlen(s)+1);
+    return off;
+}
+
+#define ITEMS(b, type) ((type *)(b).data)
+#define COUNT(b, type) ((uint32_t)((b).len / sizeof(type)))
+
+static sqlite3 *db;
+static Buf strings;
+
+static sqlite3_stmt *query(const char *sql) {
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "faces-compile: %s\n", sqlite3_errmsg(db));
+        exit(1);
+    }
+    return stmt;
+}
+
+static void exec(const char *sql) {
+    if (sqlite3_exec(db, sql, NULL, NULL, NULL) != SQLITE_OK) {
+        fprintf(stderr, "faces-compile: %s\n", sqlite3_errmsg(db));
+        exit(1);
+    }
+}
+
+static void done(sqlite3_stmt *stmt, int rv) {
+    if (SQLITE_DONE != rv) {
+        fprintf(stderr, "faces-compile: %s\n", sqlite3_errmsg(db));
+        exit(1);
+    }
+    sqlite3_finalize(stmt);
+}
+
+// label names, in the order of 'labels' (for binary search while loading)
+static char **label_names;
+
+static int find_label(const char *name, uint32_t n) {
+    uint32_t lo = 0, hi = n;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        int c = strcmp(label_names[mid], name);
+        if (0 == c)
+            return (int)mid;
+        if (c < 0)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    return -1;
+}
+
+// content hashes, with the range of faces for each
+typedef struct {
+    char *hash;
+    uint32_t first_face;
+    uint32_t n_faces;
+} Image;
+
+static int cmp_image(const void *a, const void *b) {
+    return strcmp(((const Image *)a)->hash, ((const Image *)b)->hash);
+}
+
+static int cmp_path(const void *a, const void *b) {
+    const FacesIndexPath *pa = a, *pb = b;
+    if (pa->hash != pb->hash)
+        return pa->hash < pb->hash ? -1 : 1;
+    return strcmp(strings.data + pa->path, strings.data + pb->path);
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t ua = *(const uint32_t *)a, ub = *(const uint32_t *)b;
+    return ua < ub ? -1 : ua > ub;
+}
+
+typedef struct {
+    int32_t grp;
+    uint32_t str;
+} GrpString;
+
+static int cmp_grp(const void *a, const void *b) {
+    int32_t ga = ((const GrpString *)a)->grp, gb = ((const GrpString *)b)->grp;
+    return ga < gb ? -1 : ga > gb;
+}
+
+static void align(Buf *out) {
+    while (out->len % 8)
+        buf_add(out, NULL, 1);
+}
+
+int main(int argc, char **argv) {
+    Buf paths = {0}, faces = {0}, labels = {0}, groups = {0}, files = {0}, images = {0};
+    sqlite3_stmt *stmt;
+    uint32_t i, j;
+    int rv;
+
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "usage: %s <faces.db> [<output>]\n", argv[0]);
+        return 2;
+    }
+    if (sqlite3_open_v2(argv[1], &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+        fprintf(stderr, "faces-compile: unable to open database: %s\n", argv[1]);
+        return 1;
+    }
+    // offset 0 is never a valid string, keep it as the empty string
+    buf_add(&strings, "", 1);
+    // one read transaction, so the scanner can't add faces between our queries
+    exec("BEGIN");
+
+    // Labels and their face counts, as listed in the tree
+    stmt = query("SELECT g.label, count(d.grp) "
+        "FROM face_groups g inner join face_data d on d.grp = g.grp "
+        "where g.label is not null group by g.label order by g.label");
+    while ((rv = sqlite3_step(stmt)) == SQLITE_ROW) {
+        FacesIndexLabel *l = buf_add(&labels, NULL, sizeof(FacesIndexLabel));
+        l->name = add_string(&strings, (const char *)sqlite3_column_text(stmt, 0));
+        l->count = (uint32_t)sqlite3_column_int(stmt, 1);
+    }
+    done(stmt, rv);
+    uint32_t n_labels = COUNT(labels, FacesIndexLabel);
+    label_names = calloc(n_labels+1, sizeof(char *));
+    for (i = 0; i < n_labels; i++)
+        label_names[i] = strdup(strings.data + ITEMS(labels, FacesIndexLabel)[i].name);
+
+    // Unknown face groups, largest first
+    stmt = query("select g.grp, count(d.grp) as count "
+        "from face_groups g inner join face_data d on d.grp=g.grp "
+        "where g.label='_unknown_' group by g.grp order by count desc");
+    while ((rv = sqlite3_step(stmt)) == SQLITE_ROW) {
+        FacesIndexGroup *g = buf_add(&groups, NULL, sizeof(FacesIndexGroup));
+        g->grp = sqlite3_column_int(stmt, 0);
+        g->count = (uint32_t)sqlite3_column_int(stmt, 1);
+    }
+    done(stmt, rv);
+    uint32_t n_groups = COUNT(groups, FacesIndexGroup);
+
+    // Faces, grouped by image
+    stmt = query("SELECT DISTINCT d.hash, d.left, d.top, d.right, d.bottom, g.label, g.grp, d.inpic "
+        "FROM face_data as d inner join face_groups as g on g.grp = d.grp order by d.hash");
+    Buf grps = {0};
+    while ((rv = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const char *hash = (const char *)sqlite3_column_text(stmt, 0);
+        if (!hash || sqlite3_column_type(stmt, 5) == SQLITE_NULL)
+            continue;
+        Image *img = COUNT(images, Image) ? &ITEMS(images, Image)[COUNT(images, Image)-1] : NULL;
+        if (!img || strcmp(img->hash, hash) != 0) {
+            img = buf_add(&images, NULL, sizeof(Image));
+            img->hash = strdup(hash);
+            img->first_face = COUNT(faces, FacesIndexFace);
+        }
+        FacesIndexFace *f = buf_add(&faces, NULL, sizeof(FacesIndexFace));
+        f->l = sqlite3_column_int(stmt, 1);
+        f->t = sqlite3_column_int(stmt, 2);
+        f->r = sqlite3_column_int(stmt, 3);
+        f->b = sqlite3_column_int(stmt, 4);
+        int label = find_label((const char *)sqlite3_column_text(stmt, 5), n_labels);
+        if (label < 0) {
+            fprintf(stderr, "faces-compile: face label not in the label list: %s\n", sqlite3_column_text(stmt, 5));
+            exit(1);
+        }
+        f->label = (uint32_t)label;
+        f->grp_id = sqlite3_column_int(stmt, 6);
+        f->inpic = sqlite3_column_int(stmt, 7);
+        img->n_faces++;
+        GrpString gs = { f->grp_id, 0 };
+        buf_add(&grps, &gs, sizeof(gs));
+    }
+    done(stmt, rv);
+    uint32_t n_faces = COUNT(faces, FacesIndexFace);
+    uint32_t n_images = COUNT(images, Image);
+    // SQLite's ordering of the hashes need not be ours, so sort them for lookup
+    qsort(images.data, n_images, sizeof(Image), cmp_image);
+
+    // Intern the group id strings
+    uint32_t n_grps = COUNT(grps, GrpString);
+    qsort(grps.data, n_grps, sizeof(GrpString), cmp_grp);
+    for (i = 0, j = 0; i < n_grps; i++) {
+        GrpString *g = &ITEMS(grps, GrpString)[i];
+        if (j > 0 && ITEMS(grps, GrpString)[j-1].grp == g->grp)
+            continue;
+        char txt[16];
+        snprintf(txt, sizeof(txt), "%d", g->grp);
+        ITEMS(grps, GrpString)[j].grp = g->grp;
+        ITEMS(grps, GrpString)[j].str = add_string(&strings, txt);
+        j++;
+    }
+    n_grps = j;
+    for (i = 0; i < n_faces; i++) {
+        FacesIndexFace *f = &ITEMS(faces, FacesIndexFace)[i];
+        GrpString key = { f->grp_id, 0 };
+        GrpString *g = bsearch(&key, grps.data, n_grps, sizeof(GrpString), cmp_grp);
+        f->grp = g->str;
+    }
+
+    // Paths of images that have faces
+    stmt = query("SELECT path, hash FROM file_paths");
+    while ((rv = sqlite3_step(stmt)) == SQLITE_ROW) {
+        Image key = { (char *)sqlite3_column_text(stmt, 1), 0, 0 };
+        const char *path = (const char *)sqlite3_column_text(stmt, 0);
+        if (!key.hash || !path)
+            continue;
+        Image *img = bsearch(&key, images.data, n_images, sizeof(Image), cmp_image);
+        if (!img)
+            continue;
+        FacesIndexPath *p = buf_add(&paths, NULL, sizeof(FacesIndexPath));
+        p->hash = faces_index_hash(path);
+        p->path = add_string(&strings, path);
+        p->first_face = img->first_face;
+        p->n_faces = img->n_faces;
+    }
+    done(stmt, rv);
+    exec("COMMIT");
+    uint32_t n_paths = COUNT(paths, FacesIndexPath);
+    qsort(paths.data, n_paths, sizeof(FacesIndexPath), cmp_path);
+
+    // Per-label and per-group file lists: count, then fill
+    uint32_t *lab = calloc(n_labels+1, sizeof(uint32_t));
+    uint32_t *grp = calloc(n_groups+1, sizeof(uint32_t));
+    uint32_t *seen = malloc((n_faces+1) * sizeof(uint32_t));
+    // unknown group id => index in groups ('str' holds the index here)
+    GrpString *unk = malloc((n_groups+1) * sizeof(GrpString));
+    for (i = 0; i < n_groups; i++) {
+        unk[i].grp = ITEMS(groups, FacesIndexGroup)[i].grp;
+        unk[i].str = i;
+    }
+    qsort(unk, n_groups, sizeof(GrpString), cmp_grp);
+    int pass;
+    for (pass = 0; pass < 2; pass++) {
+        if (1 == pass) {
+            // turn the counts into list offsets
+            uint32_t at = 0;
+            for (i = 0; i < n_labels; i++) {
+                FacesIndexLabel *l = &ITEMS(labels, FacesIndexLabel)[i];
+                l->first_file = at;
+                at += l->n_files;
+                lab[i] = l->first_file;
+            }
+            for (i = 0; i < n_groups; i++) {
+                FacesIndexGroup *g = &ITEMS(groups, FacesIndexGroup)[i];
+                g->first_file = at;
+                at += g->n_files;
+                grp[i] = g->first_file;
+            }
+            buf_add(&files, NULL, at * sizeof(uint32_t));
+        }
+        for (i = 0; i < n_paths; i++) {
+            FacesIndexPath *p = &ITEMS(paths, FacesIndexPath)[i];
+            uint32_t n = 0;
+            // distinct labels in this image
+            for (j = 0; j < p->n_faces; j++)
+                seen[n++] = ITEMS(faces, FacesIndexFace)[p->first_face + j].label;
+            qsort(seen, n, sizeof(uint32_t), cmp_u32);
+            for (j = 0; j < n; j++) {
+                if (j > 0 && seen[j] == seen[j-1])
+                    continue;
+                if ((int32_t)seen[j] < 0)
+                    continue;
+                if (0 == pass)
+                    ITEMS(labels, FacesIndexLabel)[seen[j]].n_files++;
+                else
+                    ITEMS(files, uint32_t)[lab[seen[j]]++] = i;
+            }
+            // and in each unknown group
+            for (j = 0, n = 0; j < p->n_faces; j++) {
+                GrpString key = { ITEMS(faces, FacesIndexFace)[p->first_face + j].grp_id, 0 };
+                GrpString *g = bsearch(&key, unk, n_groups, sizeof(GrpString), cmp_grp);
+                if (g)
+                    seen[n++] = g->str;
+            }
+            qsort(seen, n, sizeof(uint32_t), cmp_u32);
+            for (j = 0; j < n; j++) {
+                if (j > 0 && seen[j] == seen[j-1])
+                    continue;
+                if (0 == pass)
+                    ITEMS(groups, FacesIndexGroup)[seen[j]].n_files++;
+                else
+                    ITEMS(files, uint32_t)[grp[seen[j]]++] = i;
+            }
+        }
+    }
+    uint32_t n_files = COUNT(files, uint32_t);
+
+    // Assemble and write out, via a temporary file so readers never see half an index
+    Buf out = {0};
+    FacesIndexHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, FACES_INDEX_MAGIC, sizeof(FACES_INDEX_MAGIC));
+    hdr.version = FACES_INDEX_VERSION;
+    hdr.byte_order = FACES_INDEX_BYTE_ORDER;
+    hdr.n_paths = n_paths;
+    hdr.n_faces = n_faces;
+    hdr.n_labels = n_labels;
+    hdr.n_groups = n_groups;
+    hdr.n_files = n_files;
+    buf_add(&out, &hdr, sizeof(hdr));
+    align(&out);
+    hdr.paths = out.len;
+    buf_add(&out, paths.data, paths.len);
+    align(&out);
+    hdr.faces = out.len;
+    buf_add(&out, faces.data, faces.len);
+    align(&out);
+    hdr.labels = out.len;
+    buf_add(&out, labels.data, labels.len);
+    align(&out);
+    hdr.groups = out.len;
+    buf_add(&out, groups.data, groups.len);
+    align(&out);
+    hdr.files = out.len;
+    buf_add(&out, files.data, files.len);
+    align(&out);
+    hdr.strings = out.len;
+    hdr.strings_len = strings.len;
+    buf_add(&out, strings.data, strings.len);
+    memcpy(out.data, &hdr, sizeof(hdr));
+
+    char *dest = argc > 2 ? strdup(argv[2]) : malloc(strlen(argv[1]) + sizeof(FACES_INDEX_SUFFIX));
+    if (argc <= 2)
+        sprintf(dest, "%s%s", argv[1], FACES_INDEX_SUFFIX);
+    char *tmp = malloc(strlen(dest) + 5);
+    sprintf(tmp, "%s.tmp", dest);
+    FILE *fp = fopen(tmp, "wb");
+    if (!fp || fwrite(out.data, 1, out.len, fp) != out.len || fclose(fp) != 0) {
+        fprintf(stderr, "faces-compile: unable to write: %s\n", tmp);
+        remove(tmp);
+        return 1;
+    }
+    if (rename(tmp, dest) != 0) {
+        fprintf(stderr, "faces-compile: unable to rename to: %s\n", dest);
+        remove(tmp);
+        return 1;
+    }
+    printf("%s: %u paths, %u faces, %u labels, %u unknown groups (%zu bytes)\n",
+        dest, n_paths, n_faces, n_labels, n_groups, out.len);
+    sqlite3_close(db);
+    return 0;
+}
@@ -0,0 +1,90 @@
+/* -*- Mode: C; tab-width: 4; expand-tabs; indent-tabs-mode: t; c-basic-offset: 4 -*- */
+
+/*
+ *  Faces extension - binary index format
+ *
+ *  A read-only snapshot of faces.db written by faces-compile and mapped into
+ *  memory by the extension, so lookups need neither SQLite nor any copying.
+ *  All integers are in the byte order of the machine that wrote the file,
+ *  the extension ignores (and falls back to SQLite for) any file it cannot
+ *  read natively.
+ *
+ *  Layout: header, then each section aligned to 8 bytes:
+ *    paths   - FacesIndexPath, sorted by (path hash, path)
+ *    faces   - FacesIndexFace, grouped by image (file content hash)
+ *    labels  - FacesIndexLabel, sorted by name (as SQLite sorts labels)
+ *    groups  - FacesIndexGroup, _unknown_ groups only, by count descending
+ *    files   - uint32_t path indices, the per-label/group file lists
+ *    strings - NUL terminated strings, referenced by byte offset
+ */
+
+#ifndef FACES_INDEX_H
+#define FACES_INDEX_H
+
+#include <stdint.h>
+
+#define FACES_INDEX_MAGIC "FACEIDX"
+#define FACES_INDEX_VERSION 1
+#define FACES_INDEX_BYTE_ORDER 0x01020304
+#define FACES_INDEX_SUFFIX ".idx"
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t n_paths;
+    uint32_t n_faces;
+    uint32_t n_labels;
+    uint32_t n_groups;
+    uint32_t n_files;
+    uint32_t reserved;
+    uint64_t paths;     // section offsets from start of file
+    uint64_t faces;
+    uint64_t labels;
+    uint64_t groups;
+    uint64_t files;
+    uint64_t strings;
+    uint64_t strings_len;
+} FacesIndexHeader;
+
+typedef struct {
+    uint64_t hash;      // faces_index_hash(path)
+    uint32_t path;      // string
+    uint32_t first_face;
+    uint32_t n_faces;
+    uint32_t reserved;
+} FacesIndexPath;
+
+typedef struct {
+    int32_t l, t, r, b;
+    int32_t inpic;
+    int32_t grp_id;
+    uint32_t grp;       // string, grp_id as text
+    uint32_t label;     // index into labels
+} FacesIndexFace;
+
+typedef struct {
+    uint32_t name;      // string
+    uint32_t count;     // number of faces with this label
+    uint32_t first_file;
+    uint32_t n_files;
+} FacesIndexLabel;
+
+typedef struct {
+    int32_t grp;
+    uint32_t count;
+    uint32_t first_file;
+    uint32_t n_files;
+} FacesIndexGroup;
+
+// FNV-1a, the path hash table key
+static inline uint64_t faces_index_hash(const char *s) {
+    uint64_t h = 14695981039346656037ULL;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+#endif
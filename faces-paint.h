@@ -0,0 +1,47 @@
+/* -*- Mode: C; tab-width: 4; expand-tabs; indent-tabs-mode: t; c-basic-offset: 4 -*- */
+
+/*
+ *  Faces extension - overlay drawing
+ *
+ *  The cairo drawing behind the face overlay, shared by the extension and
+ *  faces-bench so the benchmark times exactly what the viewer paints.
+ *  Co-ordinates are device pixels, matched faces (p > 0) are green,
+ *  others red.
+ */
+
+#ifndef FACES_PAINT_H
+#define FACES_PAINT_H
+
+#include <cairo.h>
+
+// A face in full: outline and "name (group)" label below it
+static inline void faces_draw_face(cairo_t *cr, int l, int t, int r, int b, const char *n, const char *g, int p) {
+    cairo_save(cr);
+    if (p>0)
+        cairo_set_source_rgb(cr, 0, 1.0, 0);
+    else
+        cairo_set_source_rgb(cr, 1.0, 0, 0);
+    cairo_set_line_width(cr, 2.0);
+    cairo_rectangle(cr, l, t, r-l, b-t);
+    cairo_move_to(cr, l, b+15);
+    cairo_set_font_size(cr, 12);
+    cairo_set_line_width(cr, 1.0);
+    cairo_text_path(cr, n);
+    cairo_text_path(cr, " (");
+    cairo_text_path(cr, g);
+    cairo_text_path(cr, ")");
+    cairo_stroke(cr);
+    cairo_restore(cr);
+}
+
+// Outlines only, many faces to a stroke: set the style for matched (or
+// unmatched) faces, add their cairo_rectangle()s, then cairo_stroke()
+static inline void faces_outline_style(cairo_t *cr, int matched) {
+    if (matched)
+        cairo_set_source_rgb(cr, 0, 1.0, 0);
+    else
+        cairo_set_source_rgb(cr, 1.0, 0, 0);
+    cairo_set_line_width(cr, 2.0);
+}
+
+#endif
@@ -33,24 +33,95 @@
 #include <config.h>
 #include <gtk/gtk.h>
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <gthumb.h>
 #include <sqlite3.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <time.h>
+#include "faces-index.h"
+#include "faces-paint.h"
 
 // where we store our prefs (in dconf-editor)
 #define GTHUMB_FACES_SCHEMA GTHUMB_SCHEMA ".faces"
 #define PREF_FACES_DBPATH "dbpath"
 #define PREF_FACES_IUNKNOWN "iterate-unknown"
+#define PREF_FACES_LABEL_DELAY "label-delay"
 
-// Database handle and default location
-static sqlite3 *db = NULL;
+// Default database location
 static char *dbfile = "/home/shared/photos/faces.db";
 
 // Are we iterating unknown faces?
 static gboolean iterate_unk = FALSE;
 
+// How long (ms) the view must be still before face labels are drawn
+static int label_delay = 150;
+
+// Pre-built label summary entry (one per tree folder below face:///)
+typedef struct {
+    gchar *name;    // label, or _unknown_:<grp>
+    gchar *uri;     // face:///<escaped name>
+    int count;      // number of faces with this label
+} LabelCount;
+
+// Co-occurrence ("often photographed with"): a sparse label x label matrix of
+// shared image counts, one row per interned label id.
+typedef struct {
+    guint id;
+    guint count;
+} CoCount;
+typedef struct {
+    GHashTable *counts;     // other label id+1 => shared image count
+    GArray *ranked;         // CoCount, most shared first (NULL when stale)
+} CoRow;
+
+// Database state, one per entry in the dbpath setting. Databases often live on
+// (slow) network mounts, so each is opened and warmed up on its own background
+// thread: nothing else touches the handle until 'ready' is set, after which all
+// use is serialised through 'lock'.
+#define FACES_DB_LOADING 0
+#define FACES_DB_READY   1
+#define FACES_DB_FAILED -1
+typedef struct {
+    int index;                  // position in dbpath
+    gchar *path;
+    sqlite3 *db;
+    GMutex lock;
+    gint ready;
+    GThread *loader;
+    sqlite3_stmt *find;         // faces in a file path
+    sqlite3_stmt *by_label;     // file paths with a label
+    sqlite3_stmt *by_group;     // file paths with a group id
+    GArray *labels;             // LabelCount, in tree order
+    sqlite3_stmt *data_version; // ..rebuilt when this moves (SQLite only)
+    gint labels_version;
+    GMappedFile *map;           // compiled index (faces-compile), when current
+    const FacesIndexHeader *idx;
+    GHashTable *label_ids;      // label => id+1
+    GPtrArray *label_names;     // id => label
+    GPtrArray *with;            // id => CoRow *
+    sqlite3_int64 with_rowid;   // last face_data row counted in 'with'
+    sqlite3_stmt *max_rowid;    // ..and what we need to keep it up to date
+    sqlite3_stmt *new_faces;
+    sqlite3_stmt *image_labels;
+    gchar *threshold;           // face_scanner_config, read once for the settings dialog
+    gint64 warm_us;             // time taken to open & warm up
+    guint n_queries;            // query latency, for the diagnostics
+    guint n_late;
+    gint64 last_us;
+    gint64 total_us;
+    gint64 max_us;
+    gint busy;                  // late answers outstanding, skipped until they arrive
+} FacesDb;
+// FacesDb *, published once the settings have been read
+static GPtrArray *faces_dbs = NULL;
+static GThread *faces_dbs_loader = NULL;
+static GMutex stats_lock;
+
+// Label summary merged across databases (main thread only)
+static GArray *faces_labels = NULL;         // LabelCount, in tree order
+static GHashTable *faces_label_uris = NULL; // uri => LabelCount *
+
 // local debug messages
 static void _dbg(const char *fmt, ...)
 {
@@ -71,65 +142,1335 @@ static void _dbg(const char *fmt, ...)
     }
 }
 
-// face query function, used by both load intercept and render overlay methods
-static void find_faces(char *path, void (*fcb)(int,int,int,int,const char*,const char*,int,gpointer), gpointer user) {
+// ** Database loading (background thread) **
+
+// Queries we keep prepared for the life of the database handle
+#define SQL_FIND_FACES \
+    "SELECT DISTINCT d.left, d.top, d.right, d.bottom, g.label, g.grp, d.inpic from file_paths f inner join face_data as d on d.hash = f.hash inner join face_groups as g on g.grp = d.grp where f.path = ?1"
+#define SQL_BY_LABEL \
+    "SELECT DISTINCT(p.path) " \
+    "FROM face_groups as g " \
+    "INNER JOIN face_data as d ON g.grp = d.grp " \
+    "INNER JOIN file_paths as p ON p.hash = d.hash " \
+    "WHERE g.label = ?1"
+#define SQL_BY_GROUP \
+    "SELECT DISTINCT(p.path) " \
+    "FROM face_data as d " \
+    "INNER JOIN file_paths as p ON p.hash = d.hash " \
+    "WHERE d.grp = ?1"
+// We count the number of faces associated to each label (approx number of files)
+#define SQL_LABELS \
+    "SELECT g.label, count(d.grp) " \
+    "FROM face_groups g inner join face_data d on d.grp = g.grp " \
+    "where g.label is not null group by g.label"
+#define SQL_UNKNOWNS \
+    "select g.grp, count(d.grp) as count " \
+    "from face_groups g inner join face_data d on d.grp=g.grp " \
+    "where g.label='_unknown_' group by g.grp order by count desc"
+// Bumped by every commit from another connection (i.e. the face scanner)
+#define SQL_DATA_VERSION \
+    "PRAGMA data_version"
+#define SQL_THRESHOLD \
+    "SELECT value from face_scanner_config WHERE key = 'threshold'"
+// Pull the path lookup pages into the page cache (the label queries above
+// have already walked face_groups and face_data by the time these run)
+static const char *warm_sql[] = {
+    "PRAGMA cache_size = -16384",
+    "SELECT count(*) FROM file_paths",
+    "SELECT count(path) FROM file_paths",
+    NULL
+};
+
+static void add_label(GArray *labels, const char *name, const char *uri, int count) {
+    LabelCount lc;
+    lc.name = g_strdup(name);
+    lc.uri = g_strdup(uri);
+    lc.count = count;
+    g_array_append_val(labels, lc);
+}
+
+// Group ids are per database, so unknown groups from any but the first say where from
+static char *unknown_name(FacesDb *fd, int grp) {
+    if (0 == fd->index)
+        return g_strdup_printf("_unknown_:%d", grp);
+    return g_strdup_printf("_unknown_:%d@%d", grp, fd->index);
+}
+
+static gboolean build_labels(FacesDb *fd, GArray *labels) {
+    sqlite3 *db = fd->db;
     sqlite3_stmt *stmt = NULL;
-    _dbg("faces: find_faces: %s\n", path);
-    int rv = sqlite3_prepare_v2(db,
-        "SELECT DISTINCT d.left, d.top, d.right, d.bottom, g.label, g.grp, d.inpic from file_paths f inner join face_data as d on d.hash = f.hash inner join face_groups as g on g.grp = d.grp where f.path = ?1",
-        -1 , &stmt, NULL);
-    if (SQLITE_OK != rv)
+    int rv = sqlite3_prepare_v2(db, SQL_LABELS, -1, &stmt, NULL);
+    if (SQLITE_OK != rv) {
+        fprintf(stderr, "sqlite3 failed to select labels: %d\n", rv);
+        return FALSE;
+    }
+    while ((rv = sqlite3_step(stmt)) == SQLITE_ROW) {
+        // skip _unknown_ if we are adding these below
+        const char *name = sqlite3_column_text(stmt, 0);
+        if (iterate_unk && strcmp(name, "_unknown_")==0)
+            continue;
+        char *label = g_uri_escape_string(name, "", FALSE);
+        char *face = g_strdup_printf("face:///%s", label);
+        add_label(labels, name, face, sqlite3_column_int(stmt, 1));
+        g_free(face);
+        g_free(label);
+    }
+    sqlite3_finalize(stmt);
+    if (SQLITE_DONE != rv) {
+        fprintf(stderr, "sqlite3 failed to read label row: %d\n", rv);
+        return FALSE;
+    }
+    // special hack.. iterate _unknown_ faces by group id, in descending order of quantity
+    if (iterate_unk) {
+        stmt = NULL;
+        rv = sqlite3_prepare_v2(db, SQL_UNKNOWNS, -1, &stmt, NULL);
+        if (SQLITE_OK != rv) {
+            fprintf(stderr, "sqlite3 failed to select unknown counts: %d\n", rv);
+            return FALSE;
+        }
+        while ((rv = sqlite3_step(stmt)) == SQLITE_ROW) {
+            char *name = unknown_name(fd, sqlite3_column_int(stmt, 0));
+            char *face = g_strdup_printf("face:///%s", name);
+            add_label(labels, name, face, sqlite3_column_int(stmt, 1));
+            g_free(face);
+            g_free(name);
+        }
+        sqlite3_finalize(stmt);
+        if (SQLITE_DONE != rv) {
+            fprintf(stderr, "sqlite3 failed to read unknown row: %d\n", rv);
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+// ** Compiled index: read straight from the mapping, no copies **
+
+#define IDX_PATHS(fd)   ((const FacesIndexPath *)((const char *)(fd)->idx + (fd)->idx->paths))
+#define IDX_FACES(fd)   ((const FacesIndexFace *)((const char *)(fd)->idx + (fd)->idx->faces))
+#define IDX_LABELS(fd)  ((const FacesIndexLabel *)((const char *)(fd)->idx + (fd)->idx->labels))
+#define IDX_GROUPS(fd)  ((const FacesIndexGroup *)((const char *)(fd)->idx + (fd)->idx->groups))
+#define IDX_FILES(fd)   ((const guint32 *)((const char *)(fd)->idx + (fd)->idx->files))
+#define IDX_STRING(fd, off) ((const char *)(fd)->idx + (fd)->idx->strings + (off))
+
+static gboolean index_section_ok(const FacesIndexHeader *h, gsize len, guint64 off, guint64 n, gsize size) {
+    return off % 8 == 0 && off <= len && n <= (len - off) / size;
+}
+
+// Check everything a lookup will dereference, once, so lookups need not
+static gboolean index_valid(const FacesIndexHeader *h, gsize len) {
+    guint32 i;
+    if (len < sizeof(FacesIndexHeader) ||
+        memcmp(h->magic, FACES_INDEX_MAGIC, sizeof(FACES_INDEX_MAGIC)) != 0 ||
+        h->version != FACES_INDEX_VERSION ||
+        h->byte_order != FACES_INDEX_BYTE_ORDER)
+        return FALSE;
+    if (!index_section_ok(h, len, h->paths, h->n_paths, sizeof(FacesIndexPath)) ||
+        !index_section_ok(h, len, h->faces, h->n_faces, sizeof(FacesIndexFace)) ||
+        !index_section_ok(h, len, h->labels, h->n_labels, sizeof(FacesIndexLabel)) ||
+        !index_section_ok(h, len, h->groups, h->n_groups, sizeof(FacesIndexGroup)) ||
+        !index_section_ok(h, len, h->files, h->n_files, sizeof(guint32)) ||
+        !index_section_ok(h, len, h->strings, h->strings_len, 1) ||
+        0 == h->strings_len)
+        return FALSE;
+    const char *base = (const char *)h;
+    if (base[h->strings + h->strings_len - 1] != 0)
+        return FALSE;
+    const FacesIndexPath *paths = (const FacesIndexPath *)(base + h->paths);
+    for (i = 0; i < h->n_paths; i++) {
+        if (paths[i].path >= h->strings_len || paths[i].first_face > h->n_faces ||
+            paths[i].n_faces > h->n_faces - paths[i].first_face)
+            return FALSE;
+    }
+    const FacesIndexFace *faces = (const FacesIndexFace *)(base + h->faces);
+    for (i = 0; i < h->n_faces; i++) {
+        if (faces[i].label >= h->n_labels || faces[i].grp >= h->strings_len)
+            return FALSE;
+    }
+    const FacesIndexLabel *labels = (const FacesIndexLabel *)(base + h->labels);
+    for (i = 0; i < h->n_labels; i++) {
+        if (labels[i].name >= h->strings_len || labels[i].first_file > h->n_files ||
+            labels[i].n_files > h->n_files - labels[i].first_file)
+            return FALSE;
+    }
+    const FacesIndexGroup *groups = (const FacesIndexGroup *)(base + h->groups);
+    for (i = 0; i < h->n_groups; i++) {
+        if (groups[i].first_file > h->n_files || groups[i].n_files > h->n_files - groups[i].first_file)
+            return FALSE;
+    }
+    const guint32 *files = (const guint32 *)(base + h->files);
+    for (i = 0; i < h->n_files; i++) {
+        if (files[i] >= h->n_paths)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+// Map <database>.idx, if it exists and is newer than the database
+static void index_open(FacesDb *fd) {
+    GStatBuf dbst, idxst;
+    char *path = g_strconcat(fd->path, FACES_INDEX_SUFFIX, NULL);
+    if (g_stat(path, &idxst) != 0 || g_stat(fd->path, &dbst) != 0) {
+        _dbg("faces: no index: %s\n", path);
+    } else if (idxst.st_mtim.tv_sec < dbst.st_mtim.tv_sec || (idxst.st_mtim.tv_sec == dbst.st_mtim.tv_sec &&
+            idxst.st_mtim.tv_nsec <= dbst.st_mtim.tv_nsec)) {
+        // to the nanosecond: a database written in the same second as the index is newer
+        fprintf(stderr, "faces: ignoring index not newer than database: %s\n", path);
+    } else {
+        GError *err = NULL;
+        fd->map = g_mapped_file_new(path, FALSE, &err);
+        if (!fd->map) {
+            fprintf(stderr, "faces: unable to map index: %s: %s\n", path, err->message);
+            g_error_free(err);
+        } else if (!index_valid((const FacesIndexHeader *)g_mapped_file_get_contents(fd->map), g_mapped_file_get_length(fd->map))) {
+            fprintf(stderr, "faces: ignoring invalid index: %s\n", path);
+            g_mapped_file_unref(fd->map);
+            fd->map = NULL;
+        } else {
+            fd->idx = (const FacesIndexHeader *)g_mapped_file_get_contents(fd->map);
+            _dbg("faces: using index: %s (%u paths, %u faces, %u labels)\n", path,
+                fd->idx->n_paths, fd->idx->n_faces, fd->idx->n_labels);
+        }
+    }
+    g_free(path);
+}
+
+static const FacesIndexPath *index_find_path(FacesDb *fd, const char *path) {
+    const FacesIndexPath *paths = IDX_PATHS(fd);
+    guint64 hash = faces_index_hash(path);
+    guint32 lo = 0, hi = fd->idx->n_paths;
+    while (lo < hi) {
+        guint32 mid = lo + (hi - lo) / 2;
+        if (paths[mid].hash < hash)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    for (; lo < fd->idx->n_paths && paths[lo].hash == hash; lo++) {
+        if (strcmp(IDX_STRING(fd, paths[lo].path), path) == 0)
+            return &paths[lo];
+    }
+    return NULL;
+}
+
+static const FacesIndexLabel *index_find_label(FacesDb *fd, const char *name) {
+    const FacesIndexLabel *labels = IDX_LABELS(fd);
+    guint32 lo = 0, hi = fd->idx->n_labels;
+    while (lo < hi) {
+        guint32 mid = lo + (hi - lo) / 2;
+        int c = strcmp(IDX_STRING(fd, labels[mid].name), name);
+        if (0 == c)
+            return &labels[mid];
+        if (c < 0)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    return NULL;
+}
+
+// Same summary as build_labels, from the index
+static void index_build_labels(FacesDb *fd, GArray *labels) {
+    guint32 i;
+    for (i = 0; i < fd->idx->n_labels; i++) {
+        const FacesIndexLabel *l = &IDX_LABELS(fd)[i];
+        const char *name = IDX_STRING(fd, l->name);
+        if (iterate_unk && strcmp(name, "_unknown_")==0)
+            continue;
+        char *label = g_uri_escape_string(name, "", FALSE);
+        char *face = g_strdup_printf("face:///%s", label);
+        add_label(labels, name, face, l->count);
+        g_free(face);
+        g_free(label);
+    }
+    if (iterate_unk) {
+        for (i = 0; i < fd->idx->n_groups; i++) {
+            const FacesIndexGroup *g = &IDX_GROUPS(fd)[i];
+            char *name = unknown_name(fd, g->grp);
+            char *face = g_strdup_printf("face:///%s", name);
+            add_label(labels, name, face, g->count);
+            g_free(face);
+            g_free(name);
+        }
+    }
+}
+
+// ** Co-occurrence matrix **
+
+// One pass over face_data, each image's labels arrive together
+#define SQL_WITH \
+    "SELECT d.hash, g.label FROM face_data d inner join face_groups g on g.grp = d.grp " \
+    "where g.label != '_unknown_' group by d.hash, g.label order by d.hash"
+#define SQL_MAX_ROWID \
+    "SELECT max(rowid) FROM face_data"
+#define SQL_NEW_FACES \
+    "SELECT d.rowid, d.hash, g.label FROM face_data d inner join face_groups g on g.grp = d.grp " \
+    "where d.rowid > ?1 order by d.rowid"
+#define SQL_IMAGE_LABELS \
+    "SELECT DISTINCT g.label FROM face_data d inner join face_groups g on g.grp = d.grp " \
+    "where d.hash = ?1 and d.rowid < ?2"
+
+static guint label_intern(FacesDb *fd, const char *name) {
+    gpointer id = g_hash_table_lookup(fd->label_ids, name);
+    if (id)
+        return GPOINTER_TO_UINT(id) - 1;
+    char *copy = g_strdup(name);
+    g_ptr_array_add(fd->label_names, copy);
+    g_ptr_array_add(fd->with, g_new0(CoRow, 1));
+    g_hash_table_insert(fd->label_ids, copy, GUINT_TO_POINTER(fd->label_names->len));
+    return fd->label_names->len - 1;
+}
+
+static void with_inc(FacesDb *fd, guint a, guint b) {
+    CoRow *row = g_ptr_array_index(fd->with, a);
+    if (!row->counts)
+        row->counts = g_hash_table_new(g_direct_hash, g_direct_equal);
+    gpointer key = GUINT_TO_POINTER(b+1);
+    guint n = GPOINTER_TO_UINT(g_hash_table_lookup(row->counts, key));
+    g_hash_table_insert(row->counts, key, GUINT_TO_POINTER(n+1));
+    if (row->ranked) {
+        g_array_free(row->ranked, TRUE);
+        row->ranked = NULL;
+    }
+}
+
+// Count every pair of (distinct) labels seen in one image
+static void with_add_image(FacesDb *fd, const guint *ids, guint n) {
+    guint i, j;
+    for (i = 0; i < n; i++) {
+        for (j = i+1; j < n; j++) {
+            with_inc(fd, ids[i], ids[j]);
+            with_inc(fd, ids[j], ids[i]);
+        }
+    }
+}
+
+static gboolean with_build_sql(FacesDb *fd) {
+    sqlite3_stmt *stmt = NULL;
+    GArray *ids = g_array_new(FALSE, FALSE, sizeof(guint));
+    char *hash = NULL;
+    int rv;
+    // a single read transaction, so the rowid matches what we counted
+    sqlite3_exec(fd->db, "BEGIN", NULL, NULL, NULL);
+    if (sqlite3_step(fd->max_rowid) == SQLITE_ROW)
+        fd->with_rowid = sqlite3_column_int64(fd->max_rowid, 0);
+    sqlite3_reset(fd->max_rowid);
+    rv = sqlite3_prepare_v2(fd->db, SQL_WITH, -1, &stmt, NULL);
+    if (SQLITE_OK != rv) {
+        fprintf(stderr, "faces: unable to select image labels: %d\n", rv);
+        goto out;
+    }
+    while ((rv = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const char *h = sqlite3_column_text(stmt, 0);
+        if (!h || (hash && strcmp(hash, h) != 0)) {
+            with_add_image(fd, (guint *)ids->data, ids->len);
+            g_array_set_size(ids, 0);
+        }
+        g_free(hash);
+        hash = g_strdup(h);
+        guint id = label_intern(fd, sqlite3_column_text(stmt, 1));
+        g_array_append_val(ids, id);
+    }
+    with_add_image(fd, (guint *)ids->data, ids->len);
+    sqlite3_finalize(stmt);
+    if (SQLITE_DONE != rv)
+        fprintf(stderr, "faces: unable to read image labels: %d\n", rv);
+out:
+    sqlite3_exec(fd->db, "COMMIT", NULL, NULL, NULL);
+    g_free(hash);
+    g_array_free(ids, TRUE);
+    return SQLITE_DONE == rv;
+}
+
+static void with_build_index(FacesDb *fd) {
+    guint32 i, j;
+    guint8 *seen = g_malloc0(fd->idx->n_faces + 1);
+    GArray *ids = g_array_new(FALSE, FALSE, sizeof(guint));
+    for (i = 0; i < fd->idx->n_labels; i++)
+        label_intern(fd, IDX_STRING(fd, IDX_LABELS(fd)[i].name));
+    for (i = 0; i < fd->idx->n_paths; i++) {
+        const FacesIndexPath *p = &IDX_PATHS(fd)[i];
+        // several paths can share an image, count it once
+        if (0 == p->n_faces || seen[p->first_face])
+            continue;
+        seen[p->first_face] = 1;
+        g_array_set_size(ids, 0);
+        for (j = 0; j < p->n_faces; j++) {
+            // face label indices are label ids, as interned above
+            guint id = IDX_FACES(fd)[p->first_face + j].label, k;
+            if (strcmp(g_ptr_array_index(fd->label_names, id), "_unknown_") == 0)
+                continue;
+            for (k = 0; k < ids->len && g_array_index(ids, guint, k) != id; k++)
+                ;
+            if (k == ids->len)
+                g_array_append_val(ids, id);
+        }
+        with_add_image(fd, (guint *)ids->data, ids->len);
+    }
+    g_array_free(ids, TRUE);
+    g_free(seen);
+}
+
+// Fold in faces added since we last looked (SQLite only, the index is a snapshot)
+static void with_refresh(FacesDb *fd) {
+    sqlite3_int64 last = fd->with_rowid;
+    int rv;
+    if (fd->idx || !fd->new_faces)
+        return;
+    if (sqlite3_step(fd->max_rowid) == SQLITE_ROW)
+        last = sqlite3_column_int64(fd->max_rowid, 0);
+    sqlite3_reset(fd->max_rowid);
+    if (last <= fd->with_rowid)
+        return;
+    _dbg("faces: with_refresh: rows %lld..%lld\n", (long long)fd->with_rowid, (long long)last);
+    GArray *ids = g_array_new(FALSE, FALSE, sizeof(guint));
+    sqlite3_bind_int64(fd->new_faces, 1, fd->with_rowid);
+    while ((rv = sqlite3_step(fd->new_faces)) == SQLITE_ROW) {
+        sqlite3_int64 rowid = sqlite3_column_int64(fd->new_faces, 0);
+        const char *label = sqlite3_column_text(fd->new_faces, 2);
+        fd->with_rowid = rowid;
+        if (!label || strcmp(label, "_unknown_") == 0)
+            continue;
+        guint id = label_intern(fd, label);
+        gboolean known = FALSE;
+        // labels already in this image, before this face
+        g_array_set_size(ids, 0);
+        sqlite3_bind_text(fd->image_labels, 1, sqlite3_column_text(fd->new_faces, 1), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(fd->image_labels, 2, rowid);
+        while (sqlite3_step(fd->image_labels) == SQLITE_ROW) {
+            const char *other = sqlite3_column_text(fd->image_labels, 0);
+            if (!other || strcmp(other, "_unknown_") == 0)
+                continue;
+            guint oid = label_intern(fd, other);
+            if (oid == id)
+                known = TRUE;
+            else
+                g_array_append_val(ids, oid);
+        }
+        sqlite3_reset(fd->image_labels);
+        sqlite3_clear_bindings(fd->image_labels);
+        if (!known) {
+            guint i;
+            for (i = 0; i < ids->len; i++) {
+                with_inc(fd, id, g_array_index(ids, guint, i));
+                with_inc(fd, g_array_index(ids, guint, i), id);
+            }
+        }
+    }
+    if (SQLITE_DONE != rv)
+        fprintf(stderr, "faces: with_refresh: failed to read new faces: %d\n", rv);
+    sqlite3_reset(fd->new_faces);
+    sqlite3_clear_bindings(fd->new_faces);
+    g_array_free(ids, TRUE);
+}
+
+static gint cmp_cocount(gconstpointer a, gconstpointer b, gpointer user) {
+    const CoCount *ca = a, *cb = b;
+    if (ca->count != cb->count)
+        return ca->count > cb->count ? -1 : 1;
+    return strcmp(g_ptr_array_index((GPtrArray *)user, ca->id), g_ptr_array_index((GPtrArray *)user, cb->id));
+}
+
+// Labels sharing images with 'label', most shared first (NULL if none)
+static GArray *with_ranked(FacesDb *fd, const char *label) {
+    gpointer id = g_hash_table_lookup(fd->label_ids, label);
+    if (!id)
+        return NULL;
+    CoRow *row = g_ptr_array_index(fd->with, GPOINTER_TO_UINT(id) - 1);
+    if (!row->counts)
+        return NULL;
+    if (!row->ranked) {
+        GHashTableIter it;
+        gpointer k, v;
+        row->ranked = g_array_sized_new(FALSE, FALSE, sizeof(CoCount), g_hash_table_size(row->counts));
+        g_hash_table_iter_init(&it, row->counts);
+        while (g_hash_table_iter_next(&it, &k, &v)) {
+            CoCount c = { GPOINTER_TO_UINT(k) - 1, GPOINTER_TO_UINT(v) };
+            g_array_append_val(row->ranked, c);
+        }
+        g_array_sort_with_data(row->ranked, cmp_cocount, fd->label_names);
+    }
+    return row->ranked;
+}
+
+static void with_free(FacesDb *fd) {
+    guint i;
+    for (i = 0; fd->with && i < fd->with->len; i++) {
+        CoRow *row = g_ptr_array_index(fd->with, i);
+        if (row->counts)
+            g_hash_table_destroy(row->counts);
+        if (row->ranked)
+            g_array_free(row->ranked, TRUE);
+        g_free(row);
+    }
+    if (fd->with)
+        g_ptr_array_free(fd->with, TRUE);
+    if (fd->label_ids)
+        g_hash_table_destroy(fd->label_ids);
+    if (fd->label_names)
+        g_ptr_array_free(fd->label_names, TRUE);
+    fd->with = NULL;
+    fd->label_ids = NULL;
+    fd->label_names = NULL;
+}
+
+static gint read_data_version(FacesDb *fd) {
+    gint version = 0;
+    if (sqlite3_step(fd->data_version) == SQLITE_ROW)
+        version = sqlite3_column_int(fd->data_version, 0);
+    sqlite3_reset(fd->data_version);
+    return version;
+}
+
+static gboolean warm_up(FacesDb *fd) {
+    int i, rv;
+    rv = sqlite3_prepare_v2(fd->db, SQL_FIND_FACES, -1, &fd->find, NULL);
+    if (SQLITE_OK == rv)
+        rv = sqlite3_prepare_v2(fd->db, SQL_BY_LABEL, -1, &fd->by_label, NULL);
+    if (SQLITE_OK == rv)
+        rv = sqlite3_prepare_v2(fd->db, SQL_BY_GROUP, -1, &fd->by_group, NULL);
+    if (SQLITE_OK != rv) {
         fprintf(stderr, "faces: sqlite_prepare error: %d\n", rv);
-    rv = sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+        return FALSE;
+    }
+    fd->labels = g_array_new(FALSE, FALSE, sizeof(LabelCount));
+    index_open(fd);
+    if (fd->idx) {
+        index_build_labels(fd, fd->labels);
+    } else {
+        if (sqlite3_prepare_v2(fd->db, SQL_DATA_VERSION, -1, &fd->data_version, NULL) == SQLITE_OK)
+            fd->labels_version = read_data_version(fd);
+        if (!build_labels(fd, fd->labels))
+            return FALSE;
+    }
+    fd->label_ids = g_hash_table_new(g_str_hash, g_str_equal);
+    fd->label_names = g_ptr_array_new_with_free_func(g_free);
+    fd->with = g_ptr_array_new();
+    gint64 start = g_get_monotonic_time();
+    if (fd->idx) {
+        with_build_index(fd);
+    } else if (sqlite3_prepare_v2(fd->db, SQL_MAX_ROWID, -1, &fd->max_rowid, NULL) != SQLITE_OK ||
+               !with_build_sql(fd)) {
+        fprintf(stderr, "faces: unable to build co-occurrence: %s\n", sqlite3_errmsg(fd->db));
+    } else if (sqlite3_prepare_v2(fd->db, SQL_NEW_FACES, -1, &fd->new_faces, NULL) != SQLITE_OK ||
+               sqlite3_prepare_v2(fd->db, SQL_IMAGE_LABELS, -1, &fd->image_labels, NULL) != SQLITE_OK) {
+        // still usable, just not kept up to date
+        fprintf(stderr, "faces: no co-occurrence updates: %s\n", sqlite3_errmsg(fd->db));
+    }
+    _dbg("faces: co-occurrence for %u labels built in %ldus\n", fd->label_names->len, (long)(g_get_monotonic_time() - start));
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(fd->db, SQL_THRESHOLD, -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "faces: unable to read config: %s\n", sqlite3_errmsg(fd->db));
+    } else {
+        if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_text(stmt, 0))
+            fd->threshold = g_strdup(sqlite3_column_text(stmt, 0));
+        sqlite3_finalize(stmt);
+    }
+    for (i = 0; !fd->idx && warm_sql[i] != NULL; i++) {
+        sqlite3_stmt *stmt = NULL;
+        if (sqlite3_prepare_v2(fd->db, warm_sql[i], -1, &stmt, NULL) != SQLITE_OK)
+            continue;
+        while (sqlite3_step(stmt) == SQLITE_ROW)
+            ;
+        sqlite3_finalize(stmt);
+    }
+    return TRUE;
+}
+
+static void free_labels(GArray *labels) {
+    int i;
+    for (i = 0; i < labels->len; i++) {
+        g_free(g_array_index(labels, LabelCount, i).name);
+        g_free(g_array_index(labels, LabelCount, i).uri);
+    }
+    g_array_free(labels, TRUE);
+}
+
+// Labels first by name (as SQLite groups them), then unknown groups largest first
+static gint cmp_labels(gconstpointer a, gconstpointer b) {
+    const LabelCount *la = a, *lb = b;
+    gboolean ua = g_str_has_prefix(la->name, "_unknown_:");
+    gboolean ub = g_str_has_prefix(lb->name, "_unknown_:");
+    if (ua != ub)
+        return ua ? 1 : -1;
+    if (ua && la->count != lb->count)
+        return lb->count - la->count;
+    return strcmp(la->name, lb->name);
+}
+
+// ** Label search: face:///?q=<text> **
+
+// An in-memory index over the merged label summary, so searching never goes
+// near the databases. Every word of every label is a key into one sorted
+// array, found by binary search (prefixes) or by a walk that shares the edit
+// distance rows between neighbouring keys, trie fashion (typos).
+#define FACES_SEARCH_MAX 100    // labels listed
+#define FACES_SEARCH_LEN 32     // query bytes considered
+
+typedef struct {
+    const char *key;            // folded label, from the start of a word
+    guint label;                // index into faces_labels
+} SearchKey;
+typedef struct {
+    guint label;
+    int dist;
+} SearchHit;
+
+static GArray *search_keys = NULL;          // SearchKey, sorted by key
+static GStringChunk *search_strings = NULL;
+static guint *search_seen = NULL;           // per label, search_stamp once listed
+static guint search_stamp = 0;
+
+// Labels and queries compare case folded, without accents
+static char *search_fold(const char *s) {
+    const char *a;
+    for (a = s; *a && !(*a & 0x80); a++)
+        ;
+    if (!*a)
+        return g_ascii_strdown(s, -1);
+    char *norm = g_utf8_normalize(s, -1, G_NORMALIZE_NFKD);
+    if (NULL == norm)
+        return g_ascii_strdown(s, -1);
+    char *fold = g_utf8_casefold(norm, -1);
+    char *in, *out = fold;
+    g_free(norm);
+    for (in = fold; *in; in = g_utf8_next_char(in)) {
+        gunichar c = g_utf8_get_char(in);
+        if (c >= 0x300 && c <= 0x36f)
+            continue;
+        out += g_unichar_to_utf8(c, out);
+    }
+    *out = 0;
+    return fold;
+}
+
+static gboolean search_word_char(char c) {
+    return g_ascii_isalnum(c) || (c & 0x80);
+}
+
+static gint cmp_search_keys(gconstpointer a, gconstpointer b) {
+    return strcmp(((const SearchKey *)a)->key, ((const SearchKey *)b)->key);
+}
+
+static void search_free(void) {
+    if (search_keys)
+        g_array_free(search_keys, TRUE);
+    if (search_strings)
+        g_string_chunk_free(search_strings);
+    g_free(search_seen);
+    search_keys = NULL;
+    search_strings = NULL;
+    search_seen = NULL;
+}
+
+static void search_build(GArray *labels) {
+    gint64 start = g_get_monotonic_time();
+    int i;
+    search_free();
+    search_keys = g_array_sized_new(FALSE, FALSE, sizeof(SearchKey), labels->len * 2);
+    search_strings = g_string_chunk_new(64 * 1024);
+    search_seen = g_new0(guint, labels->len);
+    search_stamp = 0;
+    for (i = 0; i < labels->len; i++) {
+        LabelCount *lc = &g_array_index(labels, LabelCount, i);
+        // unknown groups have no name worth searching for
+        if (g_str_has_prefix(lc->name, "_unknown_:"))
+            continue;
+        char *fold = search_fold(lc->name);
+        const char *key = g_string_chunk_insert(search_strings, fold);
+        const char *p;
+        g_free(fold);
+        for (p = key; *p; p++) {
+            if (search_word_char(*p) && (p == key || !search_word_char(p[-1]))) {
+                SearchKey sk = { p, i };
+                g_array_append_val(search_keys, sk);
+            }
+        }
+    }
+    g_array_sort(search_keys, cmp_search_keys);
+    _dbg("faces: search index: %u keys for %u labels in %ldus\n", search_keys->len, labels->len,
+        (long)(g_get_monotonic_time() - start));
+}
+
+static void search_hit(GArray *hits, guint label, int dist) {
+    SearchHit hit = { label, dist };
+    if (search_seen[label] == search_stamp)
+        return;
+    search_seen[label] = search_stamp;
+    g_array_append_val(hits, hit);
+}
+
+// First key after 'from' not starting with the first 'len' bytes of 'key'
+static guint search_prefix_end(guint from, const char *key, int len) {
+    guint n = search_keys->len, step = 1, lo = from + 1, hi;
+    // gallop first, skipped runs are usually short
+    while (lo + step < n && !strncmp(g_array_index(search_keys, SearchKey, lo + step).key, key, len)) {
+        lo += step;
+        step *= 2;
+    }
+    hi = MIN(lo + step, n);
+    while (lo < hi) {
+        guint mid = lo + (hi - lo) / 2;
+        if (!strncmp(g_array_index(search_keys, SearchKey, mid).key, key, len))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Keys with a prefix within 'k' edits (optimal string alignment) of the query.
+// row[d] holds the distances for the first d bytes of the current key, rows
+// for a prefix shared with the previous key are kept, and once no extension
+// of a prefix can match, every key with that prefix is skipped at once.
+static void search_fuzzy(GArray *hits, const char *q, int m, int k) {
+    guint8 row[FACES_SEARCH_LEN + 3][FACES_SEARCH_LEN + 1];
+    guint8 rmin[FACES_SEARCH_LEN + 3], best[FACES_SEARCH_LEN + 3];
+    guint i = 0, n = search_keys->len;
+    const char *prev = "";
+    int valid = 0, j;
+    for (j = 0; j <= m; j++)
+        row[0][j] = j;
+    rmin[0] = 0;
+    best[0] = m;
+    while (i < n && hits->len < FACES_SEARCH_MAX) {
+        SearchKey *sk = &g_array_index(search_keys, SearchKey, i);
+        const char *key = sk->key;
+        int d = 0;
+        while (d < valid && prev[d] == key[d])
+            d++;
+        for (;;) {
+            if (best[d] <= k) {
+                search_hit(hits, sk->label, best[d]);
+                i++;
+                break;
+            }
+            // a transposition reaches back two rows, hence rmin[d-1]
+            if ((d > 0 && rmin[d] > k && rmin[d-1] >= k) || d >= m + k) {
+                i = search_prefix_end(i, key, d);
+                break;
+            }
+            if (!key[d]) {
+                i++;
+                break;
+            }
+            guint8 *r = row[d+1], *p = row[d];
+            r[0] = rmin[d+1] = d + 1;
+            for (j = 1; j <= m; j++) {
+                int v = p[j-1] + (key[d] != q[j-1]);
+                if (p[j] + 1 < v)
+                    v = p[j] + 1;
+                if (r[j-1] + 1 < v)
+                    v = r[j-1] + 1;
+                if (d > 0 && j > 1 && key[d] == q[j-2] && key[d-1] == q[j-1] && row[d-1][j-2] + 1 < v)
+                    v = row[d-1][j-2] + 1;
+                r[j] = v;
+                if (v < rmin[d+1])
+                    rmin[d+1] = v;
+            }
+            best[d+1] = MIN(best[d], r[m]);
+            d++;
+        }
+        prev = key;
+        valid = d;
+    }
+}
+
+static gint cmp_search_hits(gconstpointer a, gconstpointer b) {
+    return ((const SearchHit *)a)->dist - ((const SearchHit *)b)->dist;
+}
+
+// Labels matching a query (SearchHit), prefix matches first then by typos
+static GArray *search_labels(const char *text) {
+    GArray *hits = g_array_new(FALSE, FALSE, sizeof(SearchHit));
+    gint64 start = g_get_monotonic_time();
+    if (NULL == search_keys)
+        return hits;
+    char *q = search_fold(text);
+    int m = MIN(strlen(q), FACES_SEARCH_LEN);
+    guint n = search_keys->len, lo = 0, hi = n, i;
+    if (0 == m)
+        goto done;
+    if (0 == ++search_stamp) {
+        memset(search_seen, 0, faces_labels->len * sizeof(guint));
+        search_stamp = 1;
+    }
+    while (lo < hi) {
+        guint mid = lo + (hi - lo) / 2;
+        if (strncmp(g_array_index(search_keys, SearchKey, mid).key, q, m) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (i = lo; i < n && hits->len < FACES_SEARCH_MAX; i++) {
+        SearchKey *sk = &g_array_index(search_keys, SearchKey, i);
+        if (strncmp(sk->key, q, m))
+            break;
+        search_hit(hits, sk->label, 0);
+    }
+    // Allow a typo from 4 bytes typed, two from 8
+    int k = m < 4 ? 0 : m < 8 ? 1 : 2;
+    if (k > 0 && hits->len < FACES_SEARCH_MAX)
+        search_fuzzy(hits, q, m, k);
+    g_array_sort(hits, cmp_search_hits);   // stable, keeps name order
+done:
+    _dbg("faces: search '%s': %u labels in %ldus\n", q, hits->len, (long)(g_get_monotonic_time() - start));
+    g_free(q);
+    return hits;
+}
+
+// Merge the summaries of all ready databases, adding up shared labels
+static void merge_labels(void) {
+    GPtrArray *dbs = g_atomic_pointer_get(&faces_dbs);
+    GArray *labels = g_array_new(FALSE, FALSE, sizeof(LabelCount));
+    GHashTable *uris = g_hash_table_new(g_str_hash, g_str_equal);
+    int i, j;
+    for (i = 0; dbs && i < dbs->len; i++) {
+        FacesDb *fd = g_ptr_array_index(dbs, i);
+        if (g_atomic_int_get(&fd->ready) != FACES_DB_READY)
+            continue;
+        for (j = 0; j < fd->labels->len; j++) {
+            LabelCount *lc = &g_array_index(fd->labels, LabelCount, j);
+            gpointer at = g_hash_table_lookup(uris, lc->uri);
+            if (at) {
+                g_array_index(labels, LabelCount, GPOINTER_TO_UINT(at) - 1).count += lc->count;
+            } else {
+                add_label(labels, lc->name, lc->uri, lc->count);
+                g_hash_table_insert(uris, lc->uri, GUINT_TO_POINTER(labels->len));
+            }
+        }
+    }
+    g_hash_table_destroy(uris);
+    g_array_sort(labels, cmp_labels);
+    if (faces_label_uris)
+        g_hash_table_destroy(faces_label_uris);
+    if (faces_labels)
+        free_labels(faces_labels);
+    faces_labels = labels;
+    faces_label_uris = g_hash_table_new(g_str_hash, g_str_equal);
+    for (i = 0; i < labels->len; i++) {
+        LabelCount *lc = &g_array_index(labels, LabelCount, i);
+        g_hash_table_insert(faces_label_uris, lc->uri, lc);
+    }
+    search_build(labels);
+}
+
+// Overall state: loading while any database is, ready if any one is
+static int faces_state(void) {
+    GPtrArray *dbs = g_atomic_pointer_get(&faces_dbs);
+    int i, state = FACES_DB_FAILED;
+    if (!dbs)
+        return FACES_DB_LOADING;
+    for (i = 0; i < dbs->len; i++) {
+        int ready = g_atomic_int_get(&((FacesDb *)g_ptr_array_index(dbs, i))->ready);
+        if (FACES_DB_LOADING == ready)
+            return FACES_DB_LOADING;
+        if (FACES_DB_READY == ready)
+            state = FACES_DB_READY;
+    }
+    return state;
+}
+
+// Back on the main loop: tell the browser the tree has something (more) to show
+static gboolean faces_db_loaded(gpointer user) {
+    FacesDb *fd = (FacesDb *)user;
+    GthMonitor *monitor = gth_main_get_default_monitor();
+    if (FACES_DB_READY == g_atomic_int_get(&fd->ready))
+        merge_labels();
+    gth_monitor_entry_points_changed(monitor);
+    if (FACES_DB_READY == g_atomic_int_get(&fd->ready)) {
+        GFile *root = g_file_new_for_uri("face:///");
+        GList *list = NULL;
+        int i;
+        for (i = fd->labels->len-1; i >= 0; i--)
+            list = g_list_prepend(list, g_file_new_for_uri(g_array_index(fd->labels, LabelCount, i).uri));
+        gth_monitor_folder_changed(monitor, root, list, GTH_MONITOR_EVENT_CREATED);
+        g_list_free_full(list, g_object_unref);
+        g_object_unref(root);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean faces_no_dbs(gpointer user) {
+    fputs("faces: no databases configured\n", stderr);
+    gth_monitor_entry_points_changed(gth_main_get_default_monitor());
+    return G_SOURCE_REMOVE;
+}
+
+static gpointer faces_db_load(gpointer user) {
+    FacesDb *fd = (FacesDb *)user;
+    gint64 start = g_get_monotonic_time();
+    int state = FACES_DB_FAILED;
+    if (sqlite3_open_v2(fd->path, &fd->db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+        fprintf(stderr, "faces: unable to open database: %s\n", fd->path);
+    } else if (!warm_up(fd)) {
+        fprintf(stderr, "faces: unable to warm up database: %s\n", fd->path);
+    } else {
+        state = FACES_DB_READY;
+    }
+    fd->warm_us = g_get_monotonic_time() - start;
+    _dbg("faces: database %s %s in %ldus\n", fd->path, state == FACES_DB_READY ? "ready" : "failed", (long)fd->warm_us);
+    g_atomic_int_set(&fd->ready, state);
+    g_idle_add(faces_db_loaded, fd);
+    return NULL;
+}
+
+// Read our database paths, then open each on its own thread so one slow or
+// missing volume holds up nobody else
+static gpointer faces_dbs_load(gpointer user) {
+    GSettings *settings = g_settings_new(GTHUMB_FACES_SCHEMA);
+    char *dbpath = g_settings_get_string(settings, PREF_FACES_DBPATH);
+    iterate_unk = g_settings_get_boolean(settings, PREF_FACES_IUNKNOWN);
+    label_delay = MAX(0, g_settings_get_int(settings, PREF_FACES_LABEL_DELAY));
+    g_object_unref(settings);
+    _dbg("faces: org.gnome.gthumb.faces[.dbpath=%s][.iterate_unknown=%s][.label_delay=%d]\n", dbpath, iterate_unk? "true" : "false", label_delay);
+    // not ':', which gvfs mount paths (smb-share:server=...) contain
+    char **paths = g_strsplit_set((dbpath && dbpath[0]) ? dbpath : dbfile, ";\n", -1);
+    g_free(dbpath);
+    GPtrArray *dbs = g_ptr_array_new();
+    int i;
+    for (i = 0; paths[i] != NULL; i++) {
+        char *path = g_strstrip(paths[i]);
+        if (!path[0])
+            continue;
+        FacesDb *fd = g_new0(FacesDb, 1);
+        fd->index = dbs->len;
+        fd->path = g_strdup(path);
+        g_mutex_init(&fd->lock);
+        g_ptr_array_add(dbs, fd);
+    }
+    g_strfreev(paths);
+    // publish before loading, so each load sees the others when merging
+    g_atomic_pointer_set(&faces_dbs, dbs);
+    for (i = 0; i < dbs->len; i++) {
+        FacesDb *fd = g_ptr_array_index(dbs, i);
+        fd->loader = g_thread_new("faces-db", faces_db_load, fd);
+    }
+    if (0 == dbs->len)
+        g_idle_add(faces_no_dbs, NULL);
+    return NULL;
+}
+
+static void faces_db_close(FacesDb *fd) {
+    if (fd->loader) {
+        g_thread_join(fd->loader);
+        fd->loader = NULL;
+    }
+    // its faces_db_loaded() may not have run yet
+    g_source_remove_by_user_data(fd);
+    if (fd->find)
+        sqlite3_finalize(fd->find);
+    if (fd->by_label)
+        sqlite3_finalize(fd->by_label);
+    if (fd->by_group)
+        sqlite3_finalize(fd->by_group);
+    if (fd->data_version)
+        sqlite3_finalize(fd->data_version);
+    if (fd->max_rowid)
+        sqlite3_finalize(fd->max_rowid);
+    if (fd->new_faces)
+        sqlite3_finalize(fd->new_faces);
+    if (fd->image_labels)
+        sqlite3_finalize(fd->image_labels);
+    if (fd->db)
+        sqlite3_close(fd->db);
+    if (fd->labels)
+        free_labels(fd->labels);
+    with_free(fd);
+    if (fd->map)
+        g_mapped_file_unref(fd->map);
+    g_mutex_clear(&fd->lock);
+    g_free(fd->threshold);
+    g_free(fd->path);
+    g_free(fd);
+}
+
+// Lock the database for use, FALSE (unlocked) if it is not (yet) available
+static gboolean faces_db_lock(FacesDb *fd) {
+    if (g_atomic_int_get(&fd->ready) != FACES_DB_READY)
+        return FALSE;
+    g_mutex_lock(&fd->lock);
+    return TRUE;
+}
+
+static void faces_db_unlock(FacesDb *fd) {
+    g_mutex_unlock(&fd->lock);
+}
+
+// ** Federation: queries fan out to every ready database in parallel **
+
+// How long we wait for the slowest database before answering without it:
+// folder listings can wait a while, image overlays hold up the viewer
+#define FACES_QUERY_TIMEOUT_MS 1000
+#define FACES_OVERLAY_TIMEOUT_MS 200
+
+typedef struct _FacesQuery FacesQuery;
+// Runs with the database locked (usually on a pool thread), returns its answer
+typedef gpointer (*FacesQueryFunc)(FacesDb *fd, FacesQuery *q);
+struct _FacesQuery {
+    gint refs;
+    GMutex lock;
+    GCond cond;
+    int pending;
+    gboolean abandoned;         // the caller stopped waiting
+    FacesQueryFunc run;
+    GDestroyNotify free_result;
+    char *arg;                  // path or label
+    int grp;                    // unknown group id, or -1
+    int only;                   // query just this database, or -1 for all
+    guint n;
+    gpointer *results;          // per database, NULL if none (in time)
+    gboolean *answered;         // per database, the task has finished
+};
+typedef struct {
+    FacesQuery *q;
+    FacesDb *fd;
+} FacesTask;
+
+static GThreadPool *faces_pool = NULL;
+
+static void faces_query_unref(FacesQuery *q) {
+    guint i;
+    if (!g_atomic_int_dec_and_test(&q->refs))
+        return;
+    for (i = 0; i < q->n; i++) {
+        if (q->results[i])
+            q->free_result(q->results[i]);
+    }
+    g_free(q->results);
+    g_free(q->answered);
+    g_free(q->arg);
+    g_mutex_clear(&q->lock);
+    g_cond_clear(&q->cond);
+    g_free(q);
+}
+
+static void faces_query_account(FacesDb *fd, gint64 us, gboolean late) {
+    g_mutex_lock(&stats_lock);
+    fd->n_queries++;
+    if (late)
+        fd->n_late++;
+    fd->last_us = us;
+    fd->total_us += us;
+    if (us > fd->max_us)
+        fd->max_us = us;
+    g_mutex_unlock(&stats_lock);
+}
+
+static gpointer faces_query_one(FacesQuery *q, FacesDb *fd) {
+    gpointer result = NULL;
+    if (faces_db_lock(fd)) {
+        result = q->run(fd, q);
+        faces_db_unlock(fd);
+    }
+    return result;
+}
+
+static void faces_query_worker(gpointer data, gpointer user) {
+    FacesTask *task = (FacesTask *)data;
+    FacesQuery *q = task->q;
+    gint64 start = g_get_monotonic_time();
+    gpointer result = faces_query_one(q, task->fd);
+    g_mutex_lock(&q->lock);
+    gboolean late = q->abandoned;
+    if (!late)
+        q->results[task->fd->index] = result;
+    else if (result)
+        q->free_result(result);
+    q->answered[task->fd->index] = TRUE;
+    q->pending--;
+    g_cond_signal(&q->cond);
+    g_mutex_unlock(&q->lock);
+    faces_query_account(task->fd, g_get_monotonic_time() - start, late);
+    if (late) {
+        // marked busy when the caller gave up on us, available again now
+        g_atomic_int_add(&task->fd->busy, -1);
+        _dbg("faces: query answered too late by: %s\n", task->fd->path);
+    }
+    faces_query_unref(q);
+    g_free(task);
+}
+
+// Ask every ready database (or just 'only'), waiting no longer than 'timeout_ms'.
+// Always on the pool, so a hung volume cannot hold up the caller for longer, and
+// a database that has not answered an earlier query is left out until it does:
+// it gets no more tasks to queue behind its lock.
+static FacesQuery *faces_query(FacesQueryFunc run, GDestroyNotify free_result, const char *arg, int grp, int only, int timeout_ms) {
+    GPtrArray *dbs = g_atomic_pointer_get(&faces_dbs);
+    GPtrArray *todo = g_ptr_array_new();
+    FacesQuery *q = g_new0(FacesQuery, 1);
+    int i;
+    q->refs = 1;
+    g_mutex_init(&q->lock);
+    g_cond_init(&q->cond);
+    q->run = run;
+    q->free_result = free_result;
+    q->arg = g_strdup(arg);
+    q->grp = grp;
+    q->only = only;
+    q->n = dbs ? dbs->len : 0;
+    q->results = g_new0(gpointer, q->n + 1);
+    q->answered = g_new0(gboolean, q->n + 1);
+    for (i = 0; i < q->n; i++) {
+        FacesDb *fd = g_ptr_array_index(dbs, i);
+        if ((only >= 0 && only != i) || g_atomic_int_get(&fd->ready) != FACES_DB_READY)
+            continue;
+        if (g_atomic_int_get(&fd->busy) > 0)
+            _dbg("faces: query skips busy database: %s\n", fd->path);
+        else
+            g_ptr_array_add(todo, fd);
+    }
+    if (todo->len > 0) {
+        gint64 deadline = g_get_monotonic_time() + timeout_ms * 1000;
+        g_mutex_lock(&q->lock);
+        for (i = 0; i < todo->len; i++) {
+            FacesTask *task = g_new0(FacesTask, 1);
+            task->q = q;
+            task->fd = g_ptr_array_index(todo, i);
+            g_atomic_int_inc(&q->refs);
+            q->pending++;
+            g_thread_pool_push(faces_pool, task, NULL);
+        }
+        while (q->pending > 0 && g_cond_wait_until(&q->cond, &q->lock, deadline))
+            ;
+        if (q->pending > 0)
+            _dbg("faces: query gave up waiting on %d database(s)\n", q->pending);
+        for (i = 0; i < todo->len; i++) {
+            FacesDb *fd = g_ptr_array_index(todo, i);
+            if (!q->answered[fd->index])
+                g_atomic_int_inc(&fd->busy);
+        }
+        q->abandoned = TRUE;
+        g_mutex_unlock(&q->lock);
+    }
+    g_ptr_array_free(todo, TRUE);
+    return q;
+}
+
+// Faces in one image, from one database
+typedef struct {
+    int l, t, r, b, p;
+    const char *n, *g;
+} FaceRow;
+typedef struct {
+    GArray *rows;
+    GStringChunk *strings;      // SQLite strings (index rows point into the mapping)
+} FaceRows;
+
+static void free_face_rows(gpointer data) {
+    FaceRows *rows = (FaceRows *)data;
+    g_array_free(rows->rows, TRUE);
+    if (rows->strings)
+        g_string_chunk_free(rows->strings);
+    g_free(rows);
+}
+
+static gpointer db_find_faces(FacesDb *fd, FacesQuery *q) {
+    FaceRows *rows = g_new0(FaceRows, 1);
+    rows->rows = g_array_new(FALSE, FALSE, sizeof(FaceRow));
+    if (fd->idx) {
+        const FacesIndexPath *p = index_find_path(fd, q->arg);
+        guint32 i;
+        for (i = 0; p && i < p->n_faces; i++) {
+            const FacesIndexFace *f = &IDX_FACES(fd)[p->first_face + i];
+            FaceRow row = { f->l, f->t, f->r, f->b, f->inpic,
+                IDX_STRING(fd, IDX_LABELS(fd)[f->label].name), IDX_STRING(fd, f->grp) };
+            g_array_append_val(rows->rows, row);
+        }
+        return rows;
+    }
+    rows->strings = g_string_chunk_new(256);
+    sqlite3_stmt *stmt = fd->find;
+    int rv = sqlite3_bind_text(stmt, 1, q->arg, -1, SQLITE_STATIC);
     if (SQLITE_OK != rv)
         fprintf(stderr, "faces: sqlite_bind error: %d\n", rv);
     while ((rv = sqlite3_step(stmt)) != SQLITE_DONE) {
-        int l, t, r, b, p;
-        const char *n, *g;
+        FaceRow row;
         if (SQLITE_ROW != rv) {
             fprintf(stderr, "faces: sqlite_step error: %d\n", rv);
             break;
         }
-        l = sqlite3_column_int(stmt, 0);
-        t = sqlite3_column_int(stmt, 1);
-        r = sqlite3_column_int(stmt, 2);
-        b = sqlite3_column_int(stmt, 3);
-        n = sqlite3_column_text(stmt, 4);
-        g = sqlite3_column_text(stmt, 5);
-        p = sqlite3_column_int(stmt, 6);
-        fcb(l,t,r,b,n,g,p,user);
+        row.l = sqlite3_column_int(stmt, 0);
+        row.t = sqlite3_column_int(stmt, 1);
+        row.r = sqlite3_column_int(stmt, 2);
+        row.b = sqlite3_column_int(stmt, 3);
+        row.n = g_string_chunk_insert_const(rows->strings, sqlite3_column_text(stmt, 4));
+        row.g = g_string_chunk_insert_const(rows->strings, sqlite3_column_text(stmt, 5));
+        row.p = sqlite3_column_int(stmt, 6);
+        g_array_append_val(rows->rows, row);
     }
-    sqlite3_finalize(stmt);
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    return rows;
+}
+
+// face query function, used by both load intercept and render overlay methods
+// Calls 'fcb' with each face and the index of the database it came from
+static void find_faces(char *path, void (*fcb)(int,int,int,int,const char*,const char*,int,int,gpointer), gpointer user) {
+    _dbg("faces: find_faces: %s\n", path);
+    FacesQuery *q = faces_query(db_find_faces, free_face_rows, path, -1, -1, FACES_OVERLAY_TIMEOUT_MS);
+    guint i, j;
+    for (i = 0; i < q->n; i++) {
+        FaceRows *rows = (FaceRows *)q->results[i];
+        for (j = 0; rows && j < rows->rows->len; j++) {
+            FaceRow *row = &g_array_index(rows->rows, FaceRow, j);
+            fcb(row->l, row->t, row->r, row->b, row->n, row->g, row->p, i, user);
+        }
+    }
+    faces_query_unref(q);
     _dbg("faces: find_faces: done\n");
 }
 
+// Paths of the images with a label (or in an unknown group), from one database
+static void free_paths(gpointer data) {
+    g_ptr_array_free((GPtrArray *)data, TRUE);
+}
+
+static gpointer db_find_paths(FacesDb *fd, FacesQuery *q) {
+    GPtrArray *paths;
+    if (fd->idx) {
+        // Paths point into the index mapping, which lives as long as the database
+        const FacesIndexLabel *l = NULL;
+        const FacesIndexGroup *g = NULL;
+        guint32 i, first = 0, n = 0;
+        paths = g_ptr_array_new();
+        if (q->grp >= 0) {
+            for (i = 0; i < fd->idx->n_groups && !g; i++) {
+                if (IDX_GROUPS(fd)[i].grp == q->grp)
+                    g = &IDX_GROUPS(fd)[i];
+            }
+            if (g) {
+                first = g->first_file;
+                n = g->n_files;
+            }
+        } else if ((l = index_find_label(fd, q->arg)) != NULL) {
+            first = l->first_file;
+            n = l->n_files;
+        }
+        for (i = 0; i < n; i++)
+            g_ptr_array_add(paths, (gpointer)IDX_STRING(fd, IDX_PATHS(fd)[IDX_FILES(fd)[first + i]].path));
+        return paths;
+    }
+    paths = g_ptr_array_new_with_free_func(g_free);
+    sqlite3_stmt *stmt = q->grp < 0 ? fd->by_label : fd->by_group;
+    int rv;
+    if (q->grp < 0)
+        rv = sqlite3_bind_text(stmt, 1, q->arg, -1, SQLITE_STATIC);
+    else
+        rv = sqlite3_bind_int(stmt, 1, q->grp);
+    if (SQLITE_OK != rv) {
+        fprintf(stderr, "faces: sqlite_bind error: %d\n", rv);
+    }
+    while ((rv = sqlite3_step(stmt)) != SQLITE_DONE) {
+        if (rv != SQLITE_ROW) {
+            fprintf(stderr, "faces: iterate_face: failed to read face data: %d\n", rv);
+            break;
+        }
+        g_ptr_array_add(paths, g_strdup(sqlite3_column_text(stmt, 0)));
+    }
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    return paths;
+}
+
+// Labels sharing images with a label, from one database
+typedef struct {
+    const char *name;
+    guint count;
+} CoName;
+
+static void free_with(gpointer data) {
+    g_array_free((GArray *)data, TRUE);
+}
+
+static gpointer db_with(FacesDb *fd, FacesQuery *q) {
+    with_refresh(fd);
+    GArray *ranked = with_ranked(fd, q->arg);
+    GArray *names = g_array_new(FALSE, FALSE, sizeof(CoName));
+    guint i;
+    for (i = 0; ranked && i < ranked->len; i++) {
+        CoCount *c = &g_array_index(ranked, CoCount, i);
+        CoName cn = { g_ptr_array_index(fd->label_names, c->id), c->count };
+        g_array_append_val(names, cn);
+    }
+    return names;
+}
+
+static gint cmp_coname(gconstpointer a, gconstpointer b) {
+    const CoName *ca = a, *cb = b;
+    if (ca->count != cb->count)
+        return ca->count > cb->count ? -1 : 1;
+    return strcmp(ca->name, cb->name);
+}
+
+// A database's label summary, rebuilt because the scanner has written to it
+typedef struct {
+    GArray *labels;
+    gint version;
+} LabelsUpdate;
+
+static void free_labels_update(gpointer data) {
+    LabelsUpdate *lu = (LabelsUpdate *)data;
+    free_labels(lu->labels);
+    g_free(lu);
+}
+
+// NULL when unchanged: a pragma, not a scan, unless there is something to read.
+// The version is only taken on by the main thread, with the labels, so an
+// update that arrives too late to be used is asked for again next time.
+static gpointer db_labels(FacesDb *fd, FacesQuery *q) {
+    if (fd->idx || !fd->data_version)
+        return NULL;
+    gint version = read_data_version(fd);
+    if (version == g_atomic_int_get(&fd->labels_version))
+        return NULL;
+    LabelsUpdate *lu = g_new0(LabelsUpdate, 1);
+    lu->labels = g_array_new(FALSE, FALSE, sizeof(LabelCount));
+    lu->version = version;
+    if (!build_labels(fd, lu->labels)) {
+        free_labels_update(lu);
+        return NULL;
+    }
+    _dbg("faces: labels of %s rebuilt at version %d\n", fd->path, version);
+    return lu;
+}
+
+// Take on any label summaries that have changed since they were built (main thread)
+static void faces_labels_refresh(void) {
+    GPtrArray *dbs = g_atomic_pointer_get(&faces_dbs);
+    FacesQuery *q = faces_query(db_labels, free_labels_update, NULL, -1, -1, FACES_QUERY_TIMEOUT_MS);
+    gboolean changed = FALSE;
+    int i;
+    for (i = 0; i < q->n; i++) {
+        LabelsUpdate *lu = (LabelsUpdate *)q->results[i];
+        if (!lu)
+            continue;
+        FacesDb *fd = g_ptr_array_index(dbs, i);
+        free_labels(fd->labels);
+        fd->labels = lu->labels;
+        g_atomic_int_set(&fd->labels_version, lu->version);
+        lu->labels = NULL;
+        g_free(lu);
+        q->results[i] = NULL;
+        changed = TRUE;
+    }
+    faces_query_unref(q);
+    if (changed)
+        merge_labels();
+}
+
 // image loader interceptor - overlays face rectangles on GthImage..
 static GthImageLoaderFunc prev_jpeg = NULL;
 static GthImageLoaderFunc prev_png = NULL;
 static void draw_to_context(cairo_t *cr, int l, int t, int r, int b, const char *n, const char *g, int p) {
-    cairo_save(cr);
-    if (p>0)
-        cairo_set_source_rgb(cr, 0, 1.0, 0);
-    else
-        cairo_set_source_rgb(cr, 1.0, 0, 0);
-    cairo_set_line_width(cr, 2.0);
-    cairo_rectangle(cr, l, t, r-l, b-t);
-    cairo_move_to(cr, l, b+15);
-    cairo_set_font_size(cr, 12);
-    cairo_set_line_width(cr, 1.0);
-    cairo_text_path(cr, n);
-    cairo_text_path(cr, " (");
-    cairo_text_path(cr, g);
-    cairo_text_path(cr, ")");
-    cairo_stroke(cr);
-    cairo_restore(cr);
+    faces_draw_face(cr, l, t, r, b, n, g, p);
     _dbg("\tfaces: draw: %s(%s)@%d,%d,%d,%d\n", n, g, l, t, r, b);
 }
 typedef struct {
     GthImage *image;
     int w, h;
 } InterceptData;
-static void draw_to_image(int l, int t, int r, int b, const char *n, const char *g, int p, gpointer user) {
+static void draw_to_image(int l, int t, int r, int b, const char *n, const char *g, int p, int db, gpointer user) {
     // Tag faces with a named rectangle =)
     InterceptData *data = (InterceptData *)user;
     cairo_surface_t *cs = gth_image_get_cairo_surface(data->image);
@@ -173,8 +1514,6 @@ static GthImage * loader_intercept (
     // Chain through to the original loader..
     GthImage *image = prev(istream, file_data, requested_size, original_width_p, original_height_p, loaded_original_p, user_data, cancellable, error);
     // Query DB, find faces in this image (if any)
-    if (!db)
-        return image;
     if (!file_data || !file_data->file) {
         fputs("faces: missing file data\n", stderr);
         return image;
@@ -234,14 +1573,42 @@ typedef struct {
     GthFileSourceClass __parent_class;
 } FacesFileSourceClass;
 
+// face:///<label>/_with_ lists the labels sharing most photos with <label>
+#define FACES_WITH "/_with_"
+// face:///?q=<text> lists the labels matching <text>, '?' in labels is always escaped
+#define FACES_SEARCH "?q="
+
+// -1: not ours, 0: root, 1: label, 2: label's _with_ view, 3: label search
 static int is_face_uri(const char *uri) {
     int rv = 1;
     if (! g_str_has_prefix(uri, "face:///"))
         rv = -1;
     else if (! strcmp(uri, "face:///"))
         rv = 0;
+    else if (g_str_has_prefix(uri+8, FACES_SEARCH))
+        rv = 3;
+    else {
+        const char *sep = strchr(uri+8, '/');
+        if (sep && ! strcmp(sep, FACES_WITH))
+            rv = 2;
+    }
     return rv;
 }
+// The (unescaped) label of a label or _with_ uri, '/' in labels is always escaped
+static char *face_uri_label(const char *uri) {
+    const char *sep = strchr(uri+8, '/');
+    if (sep)
+        return g_uri_unescape_segment(uri+8, sep, "");
+    return g_uri_unescape_string(uri+8, "");
+}
+// The (unescaped) text of a search uri
+static char *face_uri_query(const char *uri) {
+    return g_uri_unescape_string(uri+8+strlen(FACES_SEARCH), NULL);
+}
+// Only named people have a _with_ view, not _unknown_ or its groups
+static gboolean has_with_view(const char *label) {
+    return label && ! g_str_has_prefix(label, "_unknown_");
+}
 static GList *faces_file_source_get_entry_points(GthFileSource *fs) {
     _dbg("faces: file_source(%d): get_entry_points\n", ((FacesFileSource*)fs)->id);
     GList     *list = NULL;
@@ -268,30 +1635,61 @@ static void faces_file_source_update_file_info(GthFileSource *fs, GFile *file, G
     g_file_info_set_attribute_boolean(info, G_FILE_ATTRIBUTE_ACCESS_CAN_WRITE, FALSE);
     g_file_info_set_attribute_boolean(info, G_FILE_ATTRIBUTE_ACCESS_CAN_DELETE, FALSE);
     g_file_info_set_attribute_boolean(info, G_FILE_ATTRIBUTE_ACCESS_CAN_RENAME, FALSE);
+    char *label = NULL;
+    if (1 == n_face || 2 == n_face)
+        label = face_uri_label(uri);
+    else if (3 == n_face)
+        label = face_uri_query(uri);
     // Do not display fold arrow on leaf items (magic attribute name...)
-    if (n_face > 0) {
+    if (1 == n_face && !has_with_view(label)) {
         g_file_info_set_attribute_boolean(info, "gthumb::no-child", TRUE);
     }
     // The displayed  & internal name - whoo!
     char *name;
+    char buf[16];
+    if (1 == n_face && NULL == count) {
+        // Not supplied by the caller, look it up in the label summary
+        LabelCount *lc = NULL;
+        if (faces_label_uris)
+            lc = g_hash_table_lookup(faces_label_uris, uri);
+        g_snprintf(buf, sizeof(buf), "%d", lc ? lc->count : 0);
+        count = buf;
+    }
     if (0 == n_face) {
-        name = g_strdup("Faces");
+        switch (faces_state()) {
+        case FACES_DB_READY:
+            name = g_strdup("Faces");
+            break;
+        case FACES_DB_LOADING:
+            name = g_strdup("Faces (loading...)");
+            break;
+        default:
+            name = g_strdup("Faces (unavailable)");
+            break;
+        }
+    } else if (2 == n_face) {
+        name = g_strdup_printf("Often with %s", label);
+    } else if (3 == n_face) {
+        name = g_strdup_printf("Search: %s", label ? label : "");
     } else if (n_face > 0) {
-        char *tmp = g_uri_unescape_string(uri+8, "");
-        name = g_strdup_printf("%s (%s)", tmp, count);
-        g_free(tmp);
+        name = g_strdup_printf("%s (%s)", label, count);
     } else {
         name = g_strdup("Unknown");
     }
     g_file_info_set_display_name(info, name);
     g_free(name);
-    if (n_face > 0) {
-        name = g_uri_unescape_string(uri+8, "");
+    if (2 == n_face) {
+        name = g_strdup(FACES_WITH+1);
+    } else if (3 == n_face) {
+        name = g_strdup(uri+8);
+    } else if (n_face > 0) {
+        name = g_strdup(label);
     } else {
         name = g_strdup("");
     }
     g_file_info_set_name(info, name);
     g_free(name);
+    g_free(label);
     // The tree icon - double whoo!
     // We are using the generic tagging icon for now..
     GIcon *icon = g_themed_icon_new("tag-symbolic");
@@ -308,7 +1706,7 @@ static GFileInfo *faces_file_source_get_file_info(GthFileSource *fs, GFile *file
     _dbg("faces: file_source(%d): get_file_info (%s)\n", ((FacesFileSource*)fs)->id, uri);
     g_free(uri);
     GFileInfo *info = g_file_info_new();
-    faces_file_source_update_file_info(fs, file, info, "0");
+    faces_file_source_update_file_info(fs, file, info, NULL);
     return info;
 }
 static GthFileData *faces_file_source_get_file_data(GthFileSource *fs, GFile *file, GFileInfo *info) {
@@ -316,7 +1714,7 @@ static GthFileData *faces_file_source_get_file_data(GthFileSource *fs, GFile *fi
     _dbg("faces: file_source(%d): get_file_data (%s)\n", ((FacesFileSource*)fs)->id, uri);
     g_free(uri);
     if (G_FILE_TYPE_DIRECTORY == g_file_info_get_file_type(info))
-        faces_file_source_update_file_info(fs, file, info, "0");
+        faces_file_source_update_file_info(fs, file, info, NULL);
     GthFileData *data = gth_file_data_new(file, info);
     return data;
 }
@@ -328,7 +1726,7 @@ static void faces_file_source_read_metadata(GthFileSource *fs, GthFileData *fd,
     char *uri = g_file_get_uri(fd->file);
     _dbg("faces: file_source(%d): read_metadata (%s)\n", ((FacesFileSource*)fs)->id, uri);
     g_free(uri);
-    faces_file_source_update_file_info(fs, fd->file, fd->info, "0");
+    faces_file_source_update_file_info(fs, fd->file, fd->info, NULL);
     object_ready_with_error(fs, ready, user, NULL);
 }
 static void faces_file_source_rename(GthFileSource *fs, GFile *file, const char *name, ReadyCallback ready, gpointer user) {
@@ -347,73 +1745,24 @@ static void faces_file_source_iterate_faces(gpointer user) {
     FacesIterateState *state = (FacesIterateState *)user;
     char *uri = g_file_get_uri(state->parent);
     _dbg("faces: file_source(%d): iterate_faces (%s): enter\n", state->ffs->id, uri);
-    // Iterate database and extract labels..
-    if (db) {
-        sqlite3_stmt *stmt;
-        // We count the number of faces associated to each label (approx number of files)
-        int rv = sqlite3_prepare_v2(db,
-            "SELECT g.label, count(d.grp) " \
-            "FROM face_groups g inner join face_data d on d.grp = g.grp " \
-            "group by g.label",
-            -1, &stmt, NULL);
-        if (SQLITE_OK != rv) {
-            fprintf(stderr, "sqlite3 failed to select labels: %d\n", rv);
-            goto done;
-        }
-        while ((rv = sqlite3_step(stmt)) != SQLITE_DONE) {
-            if (SQLITE_ROW != rv) {
-                fprintf(stderr, "sqlite3 failed to read label row: %s\n", rv);
-                goto done;
-            }
-            // skip _unknown_ if we are adding these below
-            const char *name = sqlite3_column_text(stmt, 0);
-            if (iterate_unk && strcmp(name, "_unknown_")==0)
-                continue;
-            char *label = g_uri_escape_string(name, "", FALSE);
-            char *face = g_strdup_printf("face:///%s", label);
-            g_free(label);
-            GFile *file = g_file_new_for_uri(face);
+    // Labels come from the summaries pre-built as each database was loaded,
+    // rebuilt for any the scanner has added faces to since
+    faces_labels_refresh();
+    if (faces_labels) {
+        int i;
+        for (i = 0; i < faces_labels->len; i++) {
+            LabelCount *lc = &g_array_index(faces_labels, LabelCount, i);
+            char count[16];
+            g_snprintf(count, sizeof(count), "%d", lc->count);
+            GFile *file = g_file_new_for_uri(lc->uri);
             GFileInfo *info = g_file_info_new();
-            faces_file_source_update_file_info((GthFileSource*)state->ffs, file, info, sqlite3_column_text(stmt, 1));
-            _dbg("faces: file_source(%d): fec callback for: %s\n", state->ffs->id, face);
+            faces_file_source_update_file_info((GthFileSource*)state->ffs, file, info, count);
+            _dbg("faces: file_source(%d): fec callback for: %s\n", state->ffs->id, lc->uri);
             state->fec(file, info, state->user);
             g_object_unref(info);
             g_object_unref(file);
-            g_free(face);
-        }
-        sqlite3_finalize(stmt);
-        // special hack.. iterate _unknown_ faces by group id, in descending order of quantity
-        if (iterate_unk) {
-            _dbg("faces: file_source(%d): iterating unknown groups\n", state->ffs->id);
-            stmt = NULL;
-            rv = sqlite3_prepare_v2(db,
-                "select g.grp, count(d.grp) as count " \
-                "from face_groups g inner join face_data d on d.grp=g.grp " \
-                "where g.label='_unknown_' group by g.grp order by count desc", -1, &stmt, NULL);
-            if (SQLITE_OK != rv) {
-                fprintf(stderr, "sqlite3 failed to select unknown counts: %d\n", rv);
-                goto done;
-            }
-            while ((rv = sqlite3_step(stmt)) != SQLITE_DONE) {
-                if (SQLITE_ROW != rv) {
-                    fprintf(stderr, "sqlite3 failed to read unknown row: %d\n", rv);
-                    goto done;
-                }
-                const char *grp = sqlite3_column_text(stmt, 0);
-                const char *cnt = sqlite3_column_text(stmt, 1);
-                char *face = g_strdup_printf("face:///_unknown_:%s", grp);
-                GFile *file = g_file_new_for_uri(face);
-                GFileInfo *info = g_file_info_new();
-                faces_file_source_update_file_info((GthFileSource*)state->ffs, file, info, cnt);
-                _dbg("faces: file_source(%d): fec callback for: %s\n", state->ffs->id, face);
-                state->fec(file, info, state->user);
-                g_object_unref(info);
-                g_object_unref(file);
-                g_free(face);
-            }
         }
     }
-done:
     object_ready_with_error(state->ffs, state->ready, state->user, NULL);
     _dbg("faces: file_source(%d): iterate_faces (%s): exit\n", state->ffs->id, uri);
     g_free(uri);
@@ -424,76 +1773,164 @@ done:
 static void faces_file_source_iterate_face(gpointer user) {
     FacesIterateState *state = (FacesIterateState *)user;
     char *uri = g_file_get_uri(state->parent);
+    GPtrArray *paths;
     _dbg("faces: file_source(%d): iterate_face (%s): enter\n", state->ffs->id, uri);
     if (is_face_uri(uri) <= 0) {
         fprintf(stderr, "faces: iterate_face: not a face uri: %s\n", uri);
         goto done;
     }
-    char *face = g_uri_unescape_string(uri+8, "");
+    char *face = face_uri_label(uri);
     if (NULL == face) {
         fprintf(stderr, "faces: iterate_face: failed to unescape: %s\n", uri);
         goto done;
     }
-    if (db) {
-        char *qry_lab =
-                        "SELECT DISTINCT(p.path) " \
-                        "FROM face_groups as g " \
-                        "INNER JOIN face_data as d ON g.grp = d.grp " \
-                        "INNER JOIN file_paths as p ON p.hash = d.hash " \
-                        "WHERE g.label = ?1";
-        char *qry_grp =
-                        "SELECT DISTINCT(p.path) " \
-                        "FROM face_data as d " \
-                        "INNER JOIN file_paths as p ON p.hash = d.hash " \
-                        "WHERE d.grp = ?1";
-        int grp = -1;
-        char *qry = qry_lab;
-        if (sscanf(face, "_unknown_:%d", &grp) > 0) {
-            // unknown face label detected, use group query
-            qry = qry_grp;
-            _dbg("faces: file_source(%d): iterate face (%s): detected group: %d\n", state->ffs->id, uri, grp);
-        }
-        sqlite3_stmt *stmt;
-        int rv = sqlite3_prepare_v2(db, qry, -1, &stmt, NULL);
-        if (rv != SQLITE_OK) {
-            fprintf(stderr, "faces: iterate_face: prepare failed: %d\n", rv);
-            goto done;
+    // The "often photographed with" view comes first
+    if (has_with_view(face) && faces_state() != FACES_DB_FAILED) {
+        char *wuri = g_strconcat(uri, FACES_WITH, NULL);
+        GFile *file = g_file_new_for_uri(wuri);
+        GFileInfo *info = g_file_info_new();
+        faces_file_source_update_file_info((GthFileSource*)state->ffs, file, info, NULL);
+        _dbg("faces: file_source(%d): fec callback for: %s\n", state->ffs->id, wuri);
+        state->fec(file, info, state->user);
+        g_object_unref(info);
+        g_object_unref(file);
+        g_free(wuri);
+    }
+    // Collect paths from all databases (without duplicates), then query file info
+    int grp = -1, only = -1;
+    if (sscanf(face, "_unknown_:%d@%d", &grp, &only) > 0) {
+        // unknown face label detected, use group query (on the database it came from)
+        only = only < 0 ? 0 : only;
+        _dbg("faces: file_source(%d): iterate face (%s): detected group: %d@%d\n", state->ffs->id, uri, grp, only);
+    }
+    FacesQuery *q = faces_query(db_find_paths, free_paths, face, grp, only, FACES_QUERY_TIMEOUT_MS);
+    GHashTable *seen = g_hash_table_new(g_str_hash, g_str_equal);
+    paths = g_ptr_array_new();
+    int j;
+    for (j = 0; j < q->n; j++) {
+        GPtrArray *found = (GPtrArray *)q->results[j];
+        int k;
+        for (k = 0; found && k < found->len; k++) {
+            char *path = g_ptr_array_index(found, k);
+            if (g_hash_table_contains(seen, path))
+                continue;
+            g_hash_table_add(seen, path);
+            g_ptr_array_add(paths, path);
         }
-        if (grp<0)
-            rv = sqlite3_bind_text(stmt, 1, face, -1, SQLITE_STATIC);
-        else
-            rv = sqlite3_bind_int(stmt, 1, grp);
-        if (SQLITE_OK != rv) {
-            fprintf(stderr, "faces: sqlite_bind error: %d\n", rv);
+    }
+    g_hash_table_destroy(seen);
+    g_free(face);
+    int i;
+    for (i = 0; paths && i < paths->len; i++) {
+        char *furi = g_strdup_printf("file://%s", (char *)g_ptr_array_index(paths, i));
+        GFile *file = g_file_new_for_uri(furi);
+        g_free(furi);
+        furi = g_file_get_uri(file);
+        GError *err = NULL;
+        GFileInfo *info = g_file_query_info(file, state->attrs, 0, NULL, &err);
+        if (NULL == info) {
+            fprintf(stderr, "faces: warning: unable to read file info: %s\n", furi);
+            g_clear_error(&err);
+        } else {
+            _dbg("faces: file_source(%d): fec callback for: %s\n", state->ffs->id, furi);
+            state->fec(file, info, state->user);
+            g_object_unref(info);
         }
-        while ((rv = sqlite3_step(stmt)) != SQLITE_DONE) {
-            if (rv != SQLITE_ROW) {
-                fprintf(stderr, "faces: iterate_face: failed to read face data: %d\n", rv);
-                goto done;
-            }
-            const char *path = sqlite3_column_text(stmt, 0);
-            char *furi = g_strdup_printf("file://%s", path);
-            GFile *file = g_file_new_for_uri(furi);
-            g_free(furi);
-            furi = g_file_get_uri(file);
-            GError *err = NULL;
-            GFileInfo *info = g_file_query_info(file, state->attrs, 0, NULL, &err);
-            if (NULL == info) {
-                fprintf(stderr, "faces: warning: unable to read file info: %s\n", furi);
-            } else {
-                _dbg("faces: file_source(%d): fec callback for: %s\n", state->ffs->id, furi);
-                state->fec(file, info, state->user);
-                g_object_unref(info);
+        g_free(furi);
+        g_object_unref(file);
+    }
+    g_ptr_array_free(paths, TRUE);
+    faces_query_unref(q);
+done:
+    object_ready_with_error(state->ffs, state->ready, state->user, NULL);
+    _dbg("faces: file_source(%d): iterate_face (%s): exit\n", state->ffs->id, uri);
+    g_free(uri);
+    if (state->attrs)
+        g_free(state->attrs);
+    g_free(state);
+}
+static void faces_file_source_iterate_with(gpointer user) {
+    FacesIterateState *state = (FacesIterateState *)user;
+    char *uri = g_file_get_uri(state->parent);
+    char *face = face_uri_label(uri);
+    _dbg("faces: file_source(%d): iterate_with (%s): enter\n", state->ffs->id, uri);
+    // Ranked from each database's co-occurrence matrix (topped up with any new
+    // faces), adding up the counts for labels found in more than one
+    if (face) {
+        FacesQuery *q = faces_query(db_with, free_with, face, -1, -1, FACES_QUERY_TIMEOUT_MS);
+        GHashTable *counts = g_hash_table_new(g_str_hash, g_str_equal);
+        GArray *ranked = g_array_new(FALSE, FALSE, sizeof(CoName));
+        int i, j;
+        for (i = 0; i < q->n; i++) {
+            GArray *names = (GArray *)q->results[i];
+            for (j = 0; names && j < names->len; j++) {
+                CoName *cn = &g_array_index(names, CoName, j);
+                gpointer at = g_hash_table_lookup(counts, cn->name);
+                if (at) {
+                    g_array_index(ranked, CoName, GPOINTER_TO_UINT(at) - 1).count += cn->count;
+                } else {
+                    g_array_append_val(ranked, *cn);
+                    g_hash_table_insert(counts, (gpointer)cn->name, GUINT_TO_POINTER(ranked->len));
+                }
             }
-            g_free(furi);
+        }
+        g_hash_table_destroy(counts);
+        g_array_sort(ranked, cmp_coname);
+        for (i = 0; i < ranked->len; i++) {
+            CoName *cn = &g_array_index(ranked, CoName, i);
+            char *label = g_uri_escape_string(cn->name, "", FALSE);
+            char *other = g_strdup_printf("face:///%s", label);
+            char count[16];
+            g_snprintf(count, sizeof(count), "%u", cn->count);
+            GFile *file = g_file_new_for_uri(other);
+            GFileInfo *info = g_file_info_new();
+            faces_file_source_update_file_info((GthFileSource*)state->ffs, file, info, count);
+            g_file_info_set_sort_order(info, i);
+            _dbg("faces: file_source(%d): fec callback for: %s\n", state->ffs->id, other);
+            state->fec(file, info, state->user);
+            g_object_unref(info);
             g_object_unref(file);
+            g_free(other);
+            g_free(label);
         }
-        sqlite3_finalize(stmt);
+        g_array_free(ranked, TRUE);
+        faces_query_unref(q);
     }
     g_free(face);
-done:
     object_ready_with_error(state->ffs, state->ready, state->user, NULL);
-    _dbg("faces: file_source(%d): iterate_face (%s): exit\n", state->ffs->id, uri);
+    _dbg("faces: file_source(%d): iterate_with (%s): exit\n", state->ffs->id, uri);
+    g_free(uri);
+    if (state->attrs)
+        g_free(state->attrs);
+    g_free(state);
+}
+static void faces_file_source_iterate_search(gpointer user) {
+    FacesIterateState *state = (FacesIterateState *)user;
+    char *uri = g_file_get_uri(state->parent);
+    char *text = face_uri_query(uri);
+    _dbg("faces: file_source(%d): iterate_search (%s): enter\n", state->ffs->id, uri);
+    // Matched against the in-memory index of the merged label summary
+    if (text && faces_labels) {
+        GArray *hits = search_labels(text);
+        int i;
+        for (i = 0; i < hits->len; i++) {
+            LabelCount *lc = &g_array_index(faces_labels, LabelCount, g_array_index(hits, SearchHit, i).label);
+            char count[16];
+            g_snprintf(count, sizeof(count), "%d", lc->count);
+            GFile *file = g_file_new_for_uri(lc->uri);
+            GFileInfo *info = g_file_info_new();
+            faces_file_source_update_file_info((GthFileSource*)state->ffs, file, info, count);
+            g_file_info_set_sort_order(info, i);
+            _dbg("faces: file_source(%d): fec callback for: %s\n", state->ffs->id, lc->uri);
+            state->fec(file, info, state->user);
+            g_object_unref(info);
+            g_object_unref(file);
+        }
+        g_array_free(hits, TRUE);
+    }
+    g_free(text);
+    object_ready_with_error(state->ffs, state->ready, state->user, NULL);
+    _dbg("faces: file_source(%d): iterate_search (%s): exit\n", state->ffs->id, uri);
     g_free(uri);
     if (state->attrs)
         g_free(state->attrs);
@@ -527,7 +1964,13 @@ static void faces_file_source_for_each_child(GthFileSource *fs, GFile *parent, g
     state->fec = fec;
     state->ready = ready;
     state->user = user;
-    if (n_face > 0) {
+    if (3 == n_face) {
+        // Labels matching a search
+        call_when_idle(faces_file_source_iterate_search, state);
+    } else if (2 == n_face) {
+        // Who else is in this face's photos
+        call_when_idle(faces_file_source_iterate_with, state);
+    } else if (n_face > 0) {
         // Face selected, go get files
         call_when_idle(faces_file_source_iterate_face, state);
     } else {
@@ -625,76 +2068,316 @@ extern GtkWidget * gth_image_viewer_page_get_image_viewer (GthViewerPage *self);
 typedef struct _FaceInfo {
     struct _FaceInfo *next;
     int l, t, r, b, p;
+    int db;                     // index in faces_dbs (group ids are per database)
     gchar *n, *g;
 } FaceInfo;
 typedef struct {
     gchar *path;
     FaceInfo *faces;
+    // Uniform grid over the faces (image co-ordinates), so painting and
+    // hit-testing only look at faces near the area of interest
+    GPtrArray *items;           // FaceInfo *
+    int gx, gy, cw, ch;         // grid origin, cell size
+    int cols, rows;
+    guint *cells;               // cols*rows+1 offsets into members
+    guint *members;             // item indices, by cell
+    guint *seen;                // per item, == mark once visited by a query
+    guint mark;
+    // Hit-testing: where a click started, and who to tell
+    GthBrowser *browser;
+    guint press_button;
+    double press_x, press_y;
+    // Progressive painting: labels only once the view stops moving
+    GtkWidget *viewer;
+    gboolean placed;            // last_* hold the view of the last paint
+    int last_x, last_y;
+    double last_z;
+    gboolean moving;
+    guint settle_id;
 } FaceCache;
+// Screen space taken by a face label, below and right of the rectangle
+#define FACES_LABEL_W 300
+#define FACES_LABEL_H 20
 // callback from find_faces
-static void cache_face(int l, int t, int r, int b, const char *n, const char *g, int p, gpointer user) {
+static void cache_face(int l, int t, int r, int b, const char *n, const char *g, int p, int db, gpointer user) {
     FaceCache *cache = (FaceCache *)user;
     FaceInfo *fi = malloc(sizeof(FaceInfo));
     fi->next = cache->faces;
-    fi->l = l;
-    fi->t = t;
-    fi->r = r;
-    fi->b = b;
+    fi->l = MIN(l, r);
+    fi->t = MIN(t, b);
+    fi->r = MAX(l, r);
+    fi->b = MAX(t, b);
     fi->p = p;
+    fi->db = db;
     fi->n = g_strdup(n);
     fi->g = g_strdup(g);
     cache->faces = fi;
     _dbg("faces: cache_face: %s\n", n);
 }
-// GLib signal handler, called when any viewer loads a file
-// We use this as a conveniant moment to query for image metadata
-static void faces_viewer_file_loaded(GthViewerPage *viewer, GthFileData *file, GFileInfo *info, gboolean success, gpointer user) {
-    gchar *path = g_file_get_path(file->file);
-    FaceCache *cache = (FaceCache *)user;
-    _dbg("faces: viewer_file_loaded(%s): %s cache=%p\n", success ? "ok" : "fail", path, cache);
-    if (success) {
-        if (NULL != cache->path)
-            g_free(cache->path);
-        cache->path = g_strdup(path);
-        if (NULL != cache->faces) {
-            FaceInfo *fi, *n;
-            for (fi = cache->faces; fi != NULL; fi = n) {
-                if (fi->n != NULL)
-                    g_free(fi->n);
-                if (fi->g != NULL)
-                    g_free(fi->g);
-                n = fi->next;
-                free(fi);
+static void cache_clear(FaceCache *cache) {
+    FaceInfo *fi, *n;
+    for (fi = cache->faces; fi != NULL; fi = n) {
+        if (fi->n != NULL)
+            g_free(fi->n);
+        if (fi->g != NULL)
+            g_free(fi->g);
+        n = fi->next;
+        free(fi);
+    }
+    cache->faces = NULL;
+    if (cache->items)
+        g_ptr_array_free(cache->items, TRUE);
+    g_free(cache->cells);
+    g_free(cache->members);
+    g_free(cache->seen);
+    cache->items = NULL;
+    cache->cells = cache->members = cache->seen = NULL;
+    cache->cols = cache->rows = 0;
+}
+// Grid cell range (inclusive) covering an image area, FALSE if none
+static gboolean cache_cells(FaceCache *cache, double l, double t, double r, double b, int *c0, int *r0, int *c1, int *r1) {
+    if (0 == cache->cols || r < cache->gx || b < cache->gy ||
+        l >= cache->gx + cache->cols * cache->cw || t >= cache->gy + cache->rows * cache->ch)
+        return FALSE;
+    *c0 = MAX(0, (int)((l - cache->gx) / cache->cw));
+    *r0 = MAX(0, (int)((t - cache->gy) / cache->ch));
+    *c1 = MIN(cache->cols - 1, (int)((r - cache->gx) / cache->cw));
+    *r1 = MIN(cache->rows - 1, (int)((b - cache->gy) / cache->ch));
+    return TRUE;
+}
+// Index the faces: about one face per cell, a face in every cell it touches
+static void cache_index(FaceCache *cache) {
+    gint64 start = g_get_monotonic_time();
+    FaceInfo *fi;
+    int gr = G_MININT, gb = G_MININT;
+    guint i, n;
+    cache->items = g_ptr_array_new();
+    cache->gx = cache->gy = G_MAXINT;
+    for (fi = cache->faces; fi != NULL; fi = fi->next) {
+        g_ptr_array_add(cache->items, fi);
+        cache->gx = MIN(cache->gx, fi->l);
+        cache->gy = MIN(cache->gy, fi->t);
+        gr = MAX(gr, fi->r);
+        gb = MAX(gb, fi->b);
+    }
+    n = cache->items->len;
+    if (0 == n)
+        return;
+    for (cache->cols = 1; (cache->cols + 1) * (cache->cols + 1) <= n; cache->cols++)
+        ;
+    cache->rows = cache->cols;
+    cache->cw = MAX(1, (gr - cache->gx) / cache->cols + 1);
+    cache->ch = MAX(1, (gb - cache->gy) / cache->rows + 1);
+    // count, then fill, the members of each cell
+    cache->cells = g_new0(guint, cache->cols * cache->rows + 1);
+    for (i = 0; i < n; i++) {
+        int c0, r0, c1, r1, c, r;
+        fi = g_ptr_array_index(cache->items, i);
+        cache_cells(cache, fi->l, fi->t, fi->r, fi->b, &c0, &r0, &c1, &r1);
+        for (r = r0; r <= r1; r++)
+            for (c = c0; c <= c1; c++)
+                cache->cells[r * cache->cols + c + 1]++;
+    }
+    for (i = 1; i <= cache->cols * cache->rows; i++)
+        cache->cells[i] += cache->cells[i-1];
+    guint *fill = g_new(guint, cache->cols * cache->rows + 1);
+    memcpy(fill, cache->cells, (cache->cols * cache->rows + 1) * sizeof(guint));
+    cache->members = g_new(guint, cache->cells[cache->cols * cache->rows]);
+    for (i = 0; i < n; i++) {
+        int c0, r0, c1, r1, c, r;
+        fi = g_ptr_array_index(cache->items, i);
+        cache_cells(cache, fi->l, fi->t, fi->r, fi->b, &c0, &r0, &c1, &r1);
+        for (r = r0; r <= r1; r++)
+            for (c = c0; c <= c1; c++)
+                cache->members[fill[r * cache->cols + c]++] = i;
+    }
+    g_free(fill);
+    cache->seen = g_new0(guint, n);
+    cache->mark = 0;
+    _dbg("faces: cache_index: %u faces, %dx%d cells of %dx%d in %ldus\n", n, cache->cols, cache->rows,
+        cache->cw, cache->ch, (long)(g_get_monotonic_time() - start));
+}
+// Call 'fn' once for each face overlapping an image area, until it returns FALSE
+static void cache_visit(FaceCache *cache, double l, double t, double r, double b, gboolean (*fn)(FaceInfo *, gpointer), gpointer user) {
+    int c0, r0, c1, r1, c, row;
+    if (!cache_cells(cache, l, t, r, b, &c0, &r0, &c1, &r1))
+        return;
+    if (0 == ++cache->mark) {
+        memset(cache->seen, 0, cache->items->len * sizeof(guint));
+        cache->mark = 1;
+    }
+    for (row = r0; row <= r1; row++) {
+        for (c = c0; c <= c1; c++) {
+            guint cell = row * cache->cols + c, i;
+            for (i = cache->cells[cell]; i < cache->cells[cell+1]; i++) {
+                guint m = cache->members[i];
+                FaceInfo *fi = g_ptr_array_index(cache->items, m);
+                if (cache->seen[m] == cache->mark)
+                    continue;
+                cache->seen[m] = cache->mark;
+                if (fi->r < l || fi->l > r || fi->b < t || fi->t > b)
+                    continue;
+                if (!fn(fi, user))
+                    return;
             }
-            cache->faces = NULL;
         }
-        find_faces(cache->path, cache_face, cache);
     }
-    g_free(path);
 }
-
 // Scale and draw face metadata from the cache over the image
 static gboolean _draw_faces = TRUE;
+typedef struct {
+    cairo_t *cr;
+    double il, it, z;
+    gboolean labels;
+    int pass;                   // rectangles only: 1 matched, 0 unmatched faces
+    int n;
+} PaintState;
+static gboolean paint_face(FaceInfo *fi, gpointer user) {
+    PaintState *ps = (PaintState *)user;
+    // rect (l,t,r,b) = (face (l,t,r,b) * z) + image (left,top)
+    int l = (int)(((double)fi->l)*ps->z + ps->il);
+    int t = (int)(((double)fi->t)*ps->z + ps->it);
+    int r = (int)(((double)fi->r)*ps->z + ps->il);
+    int b = (int)(((double)fi->b)*ps->z + ps->it);
+    if (ps->labels) {
+        draw_to_context(ps->cr, l, t, r, b, fi->n, fi->g, fi->p);
+        ps->n++;
+    } else if ((fi->p > 0) == ps->pass) {
+        // one path (and stroke) per colour
+        cairo_rectangle(ps->cr, l, t, r-l, b-t);
+        ps->n++;
+    }
+    return TRUE;
+}
+// Draw the faces overlapping a device area, returns how many
+static int paint_faces(cairo_t *cr, FaceCache *cache, double il, double it, double z, double x0, double y0, double x1, double y1, gboolean labels) {
+    PaintState ps = { cr, il, it, z, labels, 0, 0 };
+    if (z <= 0)
+        return 0;
+    // widened for the labels of faces just off the top or left
+    x0 = (x0 - FACES_LABEL_W - il) / z;
+    y0 = (y0 - FACES_LABEL_H - it) / z;
+    x1 = (x1 - il) / z;
+    y1 = (y1 - it) / z;
+    if (labels) {
+        cache_visit(cache, x0, y0, x1, y1, paint_face, &ps);
+        return ps.n;
+    }
+    cairo_save(cr);
+    for (ps.pass = 0; ps.pass < 2; ps.pass++) {
+        faces_outline_style(cr, ps.pass);
+        cache_visit(cache, x0, y0, x1, y1, paint_face, &ps);
+        cairo_stroke(cr);
+    }
+    cairo_restore(cr);
+    return ps.n;
+}
+// Device areas for everything of ours that is on screen (labels only, or all)
+typedef struct {
+    cairo_region_t *region;
+    double il, it, z;
+    gboolean labels_only;
+} InvalidateState;
+static gboolean invalidate_face(FaceInfo *fi, gpointer user) {
+    InvalidateState *is = (InvalidateState *)user;
+    cairo_rectangle_int_t rect;
+    if (!is->labels_only) {
+        // the outline is 2px wide
+        rect.x = (int)(fi->l * is->z + is->il) - 2;
+        rect.y = (int)(fi->t * is->z + is->it) - 2;
+        rect.width = (int)((fi->r - fi->l) * is->z) + 4;
+        rect.height = (int)((fi->b - fi->t) * is->z) + 4;
+        cairo_region_union_rectangle(is->region, &rect);
+    }
+    rect.x = (int)(fi->l * is->z + is->il);
+    rect.y = (int)(fi->b * is->z + is->it);
+    rect.width = FACES_LABEL_W;
+    rect.height = FACES_LABEL_H;
+    cairo_region_union_rectangle(is->region, &rect);
+    return TRUE;
+}
+// Redraw just our parts of the viewer, not the whole widget
+static void faces_invalidate(FaceCache *cache, gboolean labels_only) {
+    if (!cache->viewer)
+        return;
+    GthImageViewer *viewer = GTH_IMAGE_VIEWER(cache->viewer);
+    double z = gth_image_viewer_get_zoom(viewer);
+    InvalidateState is = { cairo_region_create(),
+        (double)(viewer->image_area.x - viewer->visible_area.x),
+        (double)(viewer->image_area.y - viewer->visible_area.y), z, labels_only };
+    if (z > 0)
+        cache_visit(cache, (-FACES_LABEL_W - is.il) / z, (-FACES_LABEL_H - is.it) / z,
+            (viewer->visible_area.width - is.il) / z, (viewer->visible_area.height - is.it) / z,
+            invalidate_face, &is);
+    if (!labels_only) {
+        // the "(faces off)" mark
+        cairo_rectangle_int_t mark = { (int)is.il, (int)is.it, 120, 20 };
+        cairo_region_union_rectangle(is.region, &mark);
+    }
+    if (!cairo_region_is_empty(is.region))
+        gtk_widget_queue_draw_region(cache->viewer, is.region);
+    _dbg("faces: invalidate: %d rectangles\n", cairo_region_num_rectangles(is.region));
+    cairo_region_destroy(is.region);
+}
+// The view has been still for label_delay, bring the labels back
+static gboolean faces_settle(gpointer user) {
+    FaceCache *cache = (FaceCache *)user;
+    cache->settle_id = 0;
+    cache->moving = FALSE;
+    faces_invalidate(cache, TRUE);
+    return G_SOURCE_REMOVE;
+}
 static void faces_paint_metadata(GthImageViewer *viewer, cairo_t *cr, gpointer user) {
+    gint64 start = g_get_monotonic_time();
+    FaceCache *cache = (FaceCache *)user;
     // We calculate co-ordinates in drawing space as follows:
     //   image (left,top) = transform(cr, (image_offset) - (scroll_offset))
     double il = (double)(viewer->image_area.x - viewer->visible_area.x);
     double it = (double)(viewer->image_area.y - viewer->visible_area.y);
+    double z = gth_image_viewer_get_zoom(viewer);
     cairo_user_to_device(cr, &il, &it);
-    // We create a fresh context, as the provided one is oddly transformed
+    // We create a fresh context, as the provided one is oddly transformed,
+    // clipped to the area being drawn (in device space)
     cairo_t *ourcr = cairo_create(cairo_get_target(cr));
+    double x0 = G_MAXINT, y0 = G_MAXINT, x1 = G_MININT, y1 = G_MININT;
+    cairo_rectangle_list_t *clip = cairo_copy_clip_rectangle_list(cr);
+    if (CAIRO_STATUS_SUCCESS == clip->status) {
+        int i;
+        for (i = 0; i < clip->num_rectangles; i++) {
+            double l = clip->rectangles[i].x, t = clip->rectangles[i].y;
+            double r = l + clip->rectangles[i].width, b = t + clip->rectangles[i].height;
+            cairo_user_to_device(cr, &l, &t);
+            cairo_user_to_device(cr, &r, &b);
+            cairo_rectangle(ourcr, l, t, r-l, b-t);
+            x0 = MIN(x0, l);
+            y0 = MIN(y0, t);
+            x1 = MAX(x1, r);
+            y1 = MAX(y1, b);
+        }
+        cairo_clip(ourcr);
+    } else {
+        cairo_clip_extents(cr, &x0, &y0, &x1, &y1);
+        cairo_user_to_device(cr, &x0, &y0);
+        cairo_user_to_device(cr, &x1, &y1);
+    }
+    cairo_rectangle_list_destroy(clip);
     if (_draw_faces) {
-        FaceCache *cache = (FaceCache *)user;
-        double z = gth_image_viewer_get_zoom(viewer);
-        FaceInfo *fi;
-        for (fi = cache->faces; fi != NULL; fi = fi->next) {
-            // rect (l,t,r,b) = (face (l,t,r,b) * z) + image (left,top)
-            int l = (int)(((double)fi->l)*z + il);
-            int t = (int)(((double)fi->t)*z + it);
-            int r = (int)(((double)fi->r)*z + il);
-            int b = (int)(((double)fi->b)*z + it);
-            draw_to_context(ourcr, l, t, r, b, fi->n, fi->g, fi->p);
+        // Any change of scroll or zoom is (part of) a gesture: rectangles only
+        // until the view has been still for label_delay
+        if (cache->placed && (cache->last_x != viewer->visible_area.x ||
+                cache->last_y != viewer->visible_area.y || cache->last_z != z)) {
+            cache->moving = TRUE;
+            if (cache->settle_id)
+                g_source_remove(cache->settle_id);
+            cache->settle_id = g_timeout_add(label_delay, faces_settle, cache);
         }
+        cache->placed = TRUE;
+        cache->last_x = viewer->visible_area.x;
+        cache->last_y = viewer->visible_area.y;
+        cache->last_z = z;
+        int n = paint_faces(ourcr, cache, il, it, z, x0, y0, x1, y1, !cache->moving);
+        _dbg("faces: paint_metadata: %d of %u faces, %s, %ldus\n", n, cache->items ? cache->items->len : 0,
+            cache->moving ? "rectangles" : "labels", (long)(g_get_monotonic_time() - start));
     } else {
         // Mark corner to show faces are disabled
         cairo_save(ourcr);
@@ -710,13 +2393,125 @@ static void faces_paint_metadata(GthImageViewer *viewer, cairo_t *cr, gpointer u
     cairo_destroy(ourcr);
 }
 
+// GLib signal handler, called when any viewer loads a file
+// We use this as a conveniant moment to query for image metadata
+static void faces_viewer_file_loaded(GthViewerPage *viewer, GthFileData *file, GFileInfo *info, gboolean success, gpointer user) {
+    gchar *path = g_file_get_path(file->file);
+    FaceCache *cache = (FaceCache *)user;
+    _dbg("faces: viewer_file_loaded(%s): %s cache=%p\n", success ? "ok" : "fail", path, cache);
+    if (success) {
+        if (NULL != cache->path)
+            g_free(cache->path);
+        cache->path = g_strdup(path);
+        cache_clear(cache);
+        find_faces(cache->path, cache_face, cache);
+        cache_index(cache);
+        // a new image is not a gesture, its first paint gets labels
+        cache->placed = FALSE;
+    }
+    g_free(path);
+}
+
+// ** Hit-testing: who is under the pointer **
+
+typedef struct {
+    double x, y;
+    FaceInfo *hit;
+} HitState;
+static gboolean hit_face(FaceInfo *fi, gpointer user) {
+    HitState *hs = (HitState *)user;
+    // the innermost (smallest) face wins where faces overlap
+    if (!hs->hit || (fi->r - fi->l) * (fi->b - fi->t) < (hs->hit->r - hs->hit->l) * (hs->hit->b - hs->hit->t))
+        hs->hit = fi;
+    return TRUE;
+}
+// Face at a widget position, and its rectangle in widget co-ordinates
+static FaceInfo *faces_hit_test(GtkWidget *widget, FaceCache *cache, double x, double y, GdkRectangle *area) {
+    GthImageViewer *viewer = GTH_IMAGE_VIEWER(widget);
+    double z = gth_image_viewer_get_zoom(viewer);
+    double il = (double)(viewer->image_area.x - viewer->visible_area.x);
+    double it = (double)(viewer->image_area.y - viewer->visible_area.y);
+    HitState hs = { (x - il) / z, (y - it) / z, NULL };
+    if (!_draw_faces || z <= 0)
+        return NULL;
+    cache_visit(cache, hs.x, hs.y, hs.x, hs.y, hit_face, &hs);
+    if (hs.hit && area) {
+        area->x = (int)(hs.hit->l * z + il);
+        area->y = (int)(hs.hit->t * z + it);
+        area->width = (int)((hs.hit->r - hs.hit->l) * z);
+        area->height = (int)((hs.hit->b - hs.hit->t) * z);
+    }
+    return hs.hit;
+}
+static gboolean faces_query_tooltip(GtkWidget *widget, gint x, gint y, gboolean keyboard, GtkTooltip *tooltip, gpointer user) {
+    GdkRectangle area;
+    FaceInfo *fi = faces_hit_test(widget, (FaceCache *)user, x, y, &area);
+    if (!fi)
+        return FALSE;
+    gchar *text = g_strdup_printf("%s (%s)", fi->n, fi->g);
+    gtk_tooltip_set_text(tooltip, text);
+    // ask again once the pointer leaves this face
+    gtk_tooltip_set_tip_area(tooltip, &area);
+    g_free(text);
+    return TRUE;
+}
+// A click on a face opens its label folder. The viewer tells us about clicks
+// (a release without a drag) once its own button handling is done, the press
+// tells us where.
+static gboolean faces_button_press(GtkWidget *widget, GdkEventButton *ev, gpointer user) {
+    FaceCache *cache = (FaceCache *)user;
+    cache->press_button = ev->button;
+    cache->press_x = ev->x;
+    cache->press_y = ev->y;
+    return FALSE;
+}
+static void faces_viewer_clicked(GthImageViewer *viewer, gpointer user) {
+    FaceCache *cache = (FaceCache *)user;
+    if (GDK_BUTTON_PRIMARY != cache->press_button)
+        return;
+    FaceInfo *fi = faces_hit_test(GTK_WIDGET(viewer), cache, cache->press_x, cache->press_y, NULL);
+    if (!fi || !fi->n || !cache->browser)
+        return;
+    char *label;
+    if (iterate_unk && fi->g && strcmp(fi->n, "_unknown_") == 0) {
+        // unknown faces are listed by group, see build_labels()
+        GPtrArray *dbs = g_atomic_pointer_get(&faces_dbs);
+        if (!dbs || fi->db >= dbs->len)
+            return;
+        label = unknown_name(g_ptr_array_index(dbs, fi->db), atoi(fi->g));
+    } else {
+        label = g_uri_escape_string(fi->n, "", FALSE);
+    }
+    char *uri = g_strdup_printf("face:///%s", label);
+    GFile *location = g_file_new_for_uri(uri);
+    _dbg("faces: viewer_clicked: opening %s\n", uri);
+    gth_browser_go_to(cache->browser, location, NULL);
+    g_object_unref(location);
+    g_free(uri);
+    g_free(label);
+}
+
 static GtkWidget *_viewer = NULL;
+static FaceCache *_cache = NULL;
+// The viewer is going: no more settling or invalidating it
+static void faces_viewer_destroy(GtkWidget *widget, gpointer user) {
+    FaceCache *cache = (FaceCache *)user;
+    _dbg("faces: viewer_destroy: cache=%p\n", cache);
+    if (cache->settle_id) {
+        g_source_remove(cache->settle_id);
+        cache->settle_id = 0;
+    }
+    cache->moving = FALSE;
+    cache->viewer = NULL;
+    if (_viewer == widget)
+        _viewer = NULL;
+}
 static gpointer faces_keypress(GthBrowser *browser, GdkEventKey *ev) {
     gboolean rv = FALSE;
     if (GDK_KEY_F == ev->keyval) {
         _draw_faces = !_draw_faces;
-        if (_viewer != NULL)
-            gtk_widget_queue_draw(_viewer);
+        if (_cache != NULL)
+            faces_invalidate(_cache, FALSE);
         rv = TRUE;
     }
     _dbg("faces_toggle_faces: state=%d, return=%d\n", _draw_faces, rv);
@@ -731,17 +2526,27 @@ static void faces_viewer_activated(GthBrowser *browser) {
         // If so: then connect to the file loaded signal for this page and add a paint
         // handler to the GthImageViewer, both sharing a cache of face data.
         FaceCache *cache = calloc(1, sizeof(FaceCache));
+        cache->browser = browser;
         g_signal_connect(page, "file-loaded", G_CALLBACK(faces_viewer_file_loaded), cache);
         // Add our painting function to render face rectangles (if enabled)
         // keep a reference to the widget to invalidate when toggling enable/disable faces
         _viewer = gth_image_viewer_page_get_image_viewer(page);
+        _cache = cache;
+        cache->viewer = _viewer;
         gth_image_viewer_add_painter(GTH_IMAGE_VIEWER(_viewer), faces_paint_metadata, cache);
+        // Who is this? tooltips on hover, their folder on click
+        gtk_widget_set_has_tooltip(_viewer, TRUE);
+        g_signal_connect(_viewer, "query-tooltip", G_CALLBACK(faces_query_tooltip), cache);
+        g_signal_connect(_viewer, "button-press-event", G_CALLBACK(faces_button_press), cache);
+        g_signal_connect(_viewer, "clicked", G_CALLBACK(faces_viewer_clicked), cache);
+        g_signal_connect(_viewer, "destroy", G_CALLBACK(faces_viewer_destroy), cache);
         _dbg("faces: viewer_activated: hooked page type: %s cache=%p\n", g_type_name(vtype), cache);
     }
 }
 
 G_MODULE_EXPORT void
 gthumb_extension_activate (void) {
+    gint64 start = g_get_monotonic_time();
     if (getenv("FACES_INTERCEPT") != NULL) {
         // Intercept image loaders
         char *mime_jpeg = "image/jpeg";
@@ -762,29 +2567,41 @@ gthumb_extension_activate (void) {
         // Hook into processing when browser viewer is activated
         gth_hook_add_callback("gth-browser-activate-viewer-page", 10, G_CALLBACK(faces_viewer_activated), NULL);
     }
-    // Read our database path and open it
-    GSettings *settings = g_settings_new(GTHUMB_FACES_SCHEMA);
-    char *dbpath = g_settings_get_string(settings, PREF_FACES_DBPATH);
-    iterate_unk = g_settings_get_boolean(settings, PREF_FACES_IUNKNOWN);
-    g_object_unref(settings);
-    _dbg("faces: org.gnome.gthumb.faces[.dbpath=%s][.iterate_unknown=%s]\n", dbpath, iterate_unk? "true" : "false");
-    if (!dbpath || !dbpath[0])
-        dbpath = dbfile;
-    // save a copy of the path name
-    dbfile = g_strdup(dbpath);
-    if (sqlite3_open_v2(dbpath, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
-        fprintf(stderr, "faces: unable to open database: %s\n", dbpath);
-        db = NULL;
-    }
+    // Settings, database open and warm-up all happen off the main thread,
+    // the tree shows a loading state until the databases are ready.
+    faces_pool = g_thread_pool_new(faces_query_worker, NULL, -1, FALSE, NULL);
+    faces_dbs_loader = g_thread_new("faces-settings", faces_dbs_load, NULL);
     // Add new branch to browser tree
     gth_main_register_file_source(faces_file_source_get_type());
+    _dbg("faces: activated in %ldus\n", (long)(g_get_monotonic_time() - start));
 }
 
 
 G_MODULE_EXPORT void
 gthumb_extension_deactivate (void) {
-    if (db)
-        sqlite3_close(db);
+    int i;
+    if (faces_dbs_loader) {
+        g_thread_join(faces_dbs_loader);
+        faces_dbs_loader = NULL;
+    }
+    // let any late answers finish before the databases go
+    if (faces_pool) {
+        g_thread_pool_free(faces_pool, FALSE, TRUE);
+        faces_pool = NULL;
+    }
+    GPtrArray *dbs = g_atomic_pointer_get(&faces_dbs);
+    g_atomic_pointer_set(&faces_dbs, NULL);
+    for (i = 0; dbs && i < dbs->len; i++)
+        faces_db_close(g_ptr_array_index(dbs, i));
+    if (dbs)
+        g_ptr_array_free(dbs, TRUE);
+    if (faces_label_uris)
+        g_hash_table_destroy(faces_label_uris);
+    if (faces_labels)
+        free_labels(faces_labels);
+    faces_label_uris = NULL;
+    faces_labels = NULL;
+    search_free();
 }
 
 
@@ -796,23 +2613,40 @@ gthumb_extension_is_configurable (void) {
 
 G_MODULE_EXPORT void
 gthumb_extension_configure (GtkWindow *parent) {
-    // Display the current database path and threshold
-    const char *thresh = "unknown";
-    if (db) {
-        sqlite3_stmt *stmt = NULL;
-        int rv = sqlite3_prepare_v2(db, "SELECT key,value from face_scanner_config WHERE key = 'threshold'", -1, &stmt, NULL);
-        if (SQLITE_OK != rv) {
-            fprintf(stderr, "faces: unable to read config: %d\n", rv);
-            return;
-        }
-        while ((rv = sqlite3_step(stmt)) != SQLITE_DONE) {
-            thresh = sqlite3_column_text(stmt, 1);
+    // Display each database path, state and latency, and the threshold
+    GPtrArray *dbs = g_atomic_pointer_get(&faces_dbs);
+    GString *msg = g_string_new(NULL);
+    const gchar *thresh = NULL;
+    int i;
+    // cached by warm_up(), so a stuck database can't hang the dialog
+    for (i = 0; dbs && i < dbs->len && !thresh; i++) {
+        FacesDb *fd = g_ptr_array_index(dbs, i);
+        if (g_atomic_int_get(&fd->ready) == FACES_DB_READY)
+            thresh = fd->threshold;
+    }
+    if (!dbs)
+        g_string_append_printf(msg, "Database: %s (loading)\n", dbfile);
+    for (i = 0; dbs && i < dbs->len; i++) {
+        FacesDb *fd = g_ptr_array_index(dbs, i);
+        const char *state = "loading";
+        switch (g_atomic_int_get(&fd->ready)) {
+        case FACES_DB_READY:
+            state = g_atomic_int_get(&fd->busy) > 0 ? "ready, busy" : "ready";
+            break;
+        case FACES_DB_FAILED:
+            state = "unavailable";
+            break;
         }
-        sqlite3_finalize(stmt);
+        g_mutex_lock(&stats_lock);
+        g_string_append_printf(msg, "Database: %s (%s, %ldms)\n  queries: %u, avg %.1fms, last %.1fms, max %.1fms, late %u\n",
+            fd->path, state, (long)(fd->warm_us/1000), fd->n_queries,
+            fd->n_queries ? fd->total_us / 1000.0 / fd->n_queries : 0.0,
+            fd->last_us / 1000.0, fd->max_us / 1000.0, fd->n_late);
+        g_mutex_unlock(&stats_lock);
     }
-    gchar *msg = g_strdup_printf("Database: %s\nThreshold: %s", dbfile, thresh);
-    GtkWidget *dialog = gtk_message_dialog_new(parent, 0, GTK_MESSAGE_ERROR, GTK_BUTTONS_CLOSE, msg);
+    g_string_append_printf(msg, "Threshold: %s", thresh ? thresh : "unknown");
+    GtkWidget *dialog = gtk_message_dialog_new(parent, 0, GTK_MESSAGE_ERROR, GTK_BUTTONS_CLOSE, "%s", msg->str);
     gtk_dialog_run(GTK_DIALOG(dialog));
     gtk_widget_destroy(dialog);
-    g_free(msg);
+    g_string_free(msg, TRUE);
 }